@@ -1,19 +1,82 @@
 #include "arc.h"
 
 namespace arc {
-	const char* error_string[] = { "", "Syntax error", "Symbol not bound", "Wrong number of arguments", "Wrong type", "File error", "" };
+	const char* error_string[] = { "", "Syntax error", "Symbol not bound", "Wrong number of arguments", "Wrong type", "File error", "", "Out of range", "Invalid image" };
+	struct pool cons_pool("cons"), closure_pool("closure"), env_pool("env");
+	std::vector<struct object*> free_queue; /* objects whose last reference is gone, to free */
+	bool freeing = false; /* free_pending is running */
+	const size_t free_step = 256; /* objects freed per release of a last reference */
+	const size_t safe_point_free_step = 64 * 1024; /* objects freed per top-level form */
+	std::vector<struct object*> heap_objects; /* every live object; defined first so that it outlives the atoms below */
+	std::vector<env_ptr> cycle_candidates; /* envs that may be in a garbage cycle */
+	bool cycle_buffering = true;
+	const size_t cycle_purge_min = 4096;
+	size_t cycle_purge_at = cycle_purge_min;
+	size_t cycle_poll_at = cycle_purge_min; /* number of candidates that makes gc_poll collect their cycles */
+	const size_t gc_min_threshold = 100000;
+	size_t gc_threshold = gc_min_threshold; /* number of objects that triggers the next collection */
 	const atom nil;
-	std::shared_ptr<struct env> global_env = std::make_shared<struct env>(nullptr); /* the global environment */
+	env_ptr global_env = make_env(nullptr, 0); /* the top-level environment */
+	std::deque<struct cell> global_cells; /* global variables, indexed by symbol */
 	/* symbols for faster execution */
-	atom sym_t, sym_quote, sym_quasiquote, sym_unquote, sym_unquote_splicing, sym_assign, sym_fn, sym_if, sym_mac, sym_apply, sym_cons, sym_sym, sym_string, sym_num, sym__, sym_o, sym_table, sym_int, sym_char, sym_do;
+	atom sym_t, sym_quote, sym_quasiquote, sym_unquote, sym_unquote_splicing, sym_assign, sym_fn, sym_if, sym_mac, sym_apply, sym_cons, sym_sym, sym_string, sym_num, sym__, sym_o, sym_table, sym_int, sym_char, sym_do, sym_vector, sym_f64array, sym_eq, sym_sorted_table, sym_imap, sym_strbuf;
 	atom err_expr; /* for error reporting */
 	atom thrown;
-	std::unordered_map<std::string, sym> sym_of_str;
-	std::unordered_map<sym, std::string> str_of_sym;
-
-	cons::cons(atom car, atom cdr) : car(car), cdr(cdr) {}
-	env::env(std::shared_ptr<struct env> parent) : parent(parent) {}
-	closure::closure(const std::shared_ptr<struct env>& env, atom args, atom body) : parent_env(env), args(args), body(body) {}
+	bool use_vm = false; /* run code with the bytecode VM instead of the node tree evaluator */
+	struct call_cache_stats call_stats;
+	struct gc_stats gc_stats;
+	std::vector<const atom*> gc_roots; /* atoms registered by gc_root */
+	int eval_depth = 0; /* forms being evaluated; collecting is safe only at 0 */
+#ifdef PRELUDE_IMAGE
+	extern const unsigned char prelude_image[]; /* image of the library, generated by the build */
+	extern const size_t prelude_image_size;
+#endif
+	/* storage of symbol names, in blocks that never move */
+	struct name_arena {
+		std::vector<std::unique_ptr<char[]>> blocks;
+		char* next = nullptr;
+		size_t left = 0;
+
+		std::string_view add(std::string_view s) {
+			if (s.empty()) return "";
+			if (s.size() > left) {
+				size_t size = std::max(s.size(), (size_t)64 * 1024);
+				blocks.emplace_back(new char[size]);
+				next = blocks.back().get();
+				left = size;
+			}
+			memcpy(next, s.data(), s.size());
+			std::string_view r(next, s.size());
+			next += s.size();
+			left -= s.size();
+			return r;
+		}
+	} sym_names;
+	std::unordered_map<std::string_view, sym> sym_of_str; /* names are in sym_names */
+	std::vector<std::string_view> str_of_sym; /* by symbol; no data for a uniq symbol not named yet */
+	unsigned long uniq_count = 0; /* number of the last uniq symbol named */
+
+	cons::cons(atom car, atom cdr) : object(T_CONS), car(car), cdr(cdr) {}
+	int_object::int_object(int64_t value) : object(T_NUM), value(value) {}
+	string_object::string_object(std::string value) : object(T_STRING), value(std::move(value)) {}
+	table_object::table_object(bool eq) : object(T_TABLE), value(eq) {}
+	sorted_table_object::sorted_table_object() : object(T_SORTED_TABLE) {}
+	strbuf_object::strbuf_object() : object(T_STRBUF) {}
+	imap_object::imap_object(const hamt& value, bool transient) : object(T_IMAP), value(value), transient(transient) {}
+	vector_object::vector_object(std::vector<atom> value) : object(T_VECTOR), value(std::move(value)) {}
+	f64array_object::f64array_object(std::vector<double> value) : object(T_F64ARRAY), value(std::move(value)) {}
+	env::env(env_ptr parent) : parent(parent) {}
+	env::env(env_ptr parent, size_t size) : parent(parent), slots(size) {}
+	closure::closure(const env_ptr& env, const lambda_ptr& fn) : object(T_CLOSURE), parent_env(env), fn(fn) {}
+	node::node(enum node_type type) : type(type) {}
+	lambda::lambda(atom args, atom body) : args(args), body(body) {}
+
+	template <> void env_ptr::destroy(struct env* p) { delete p; }
+	template <> void lambda_ptr::destroy(struct lambda* p) { delete p; }
+
+	env_ptr make_env(env_ptr parent, size_t size) {
+		return env_ptr(new struct env(std::move(parent), size));
+	}
 
 	atom vector_to_atom(const std::vector<atom>& a, int start) {
 		atom r = nil;
@@ -33,125 +96,885 @@ namespace arc {
 	}
 
 	atom& car(const atom& a) {
-		return std::get<std::shared_ptr<struct cons>>(a.val)->car;
+		return a.asp<struct cons>().car;
 	}
 
 	atom& cdr(const atom& a) {
-		return std::get<std::shared_ptr<struct cons>>(a.val)->cdr;
+		return a.asp<struct cons>().cdr;
 	}
 
 	bool no(const atom& a) {
-		return a.type == arc::T_NIL;
+		return a.type() == arc::T_NIL;
 	}
 
 	bool sym_is(const atom& a, const atom& b) {
-		return std::get<sym>(a.val) == std::get<sym>(b.val);
+		return a.symbol() == b.symbol();
 	}
 
 	bool operator ==(const atom& a, const atom& b) {
 		return iso(a, b);
 	}
 
+	uint64_t eq_bits(const atom& a);
+
+	size_t hash_atom(const atom& a) {
+		size_t r = 1;
+		switch (a.type()) {
+		case T_NIL:
+			return 0;
+		case T_CONS: {
+			const atom* p = &a; /* not a copy, which would count references on the way */
+			while (!no(*p)) {
+				r *= 31;
+				if (p->type() == T_CONS) {
+					r += hash_atom(car(*p));
+					p = &cdr(*p);
+				}
+				else {
+					r += hash_atom(*p);
+					break;
+				}
+			}
+			return r;
+		}
+		case T_STRING:
+			return std::hash<std::string>()(a.asp<std::string>());
+		case T_VECTOR: /* equal under iso, like lists */
+			for (auto& x : a.asp<std::vector<atom>>()) {
+				r *= 31;
+				r += hash_atom(x);
+			}
+			return r;
+		case T_F64ARRAY:
+			for (double x : a.asp<std::vector<double>>()) {
+				r *= 31;
+				r += std::hash<double>()(x);
+			}
+			return r;
+		case T_NUM: /* an integral double as the integer, since is finds them equal */
+			return std::hash<uint64_t>()(eq_bits(a));
+		default: /* symbols, characters and objects compared by identity */
+			return std::hash<uint64_t>()(a.bits);
+		}
+	}
+
+	/* the bits an eq table hashes; equal numbers have the same, like 0 and -0,
+	   or a large integer and the double of it */
+	uint64_t eq_bits(const atom& a) {
+		if (a.type() != T_NUM) return a.bits;
+		if (a.is_int()) return (uint64_t)a.integer();
+		double x = a.number();
+		if (x >= -0x1p63 && x < 0x1p63 && x == trunc(x)) return (uint64_t)(int64_t)x;
+		return a.bits;
+	}
+
+	/* the same key of an eq table: the same value, or equal numbers */
+	bool eq_same(const atom& a, const atom& b) {
+		return a.bits == b.bits || (a.type() == T_NUM && b.type() == T_NUM && is(a, b));
+	}
+
+	/* mixes the bits of hash_atom, whose hashes of numbers and symbols may
+	   differ only in a few bits */
+	uint64_t mix_hash(uint64_t h) {
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ULL;
+		h ^= h >> 33;
+		return h;
+	}
+
+	uint64_t table::hash(const atom& key) const {
+		return mix_hash(eq ? eq_bits(key) : hash_atom(key));
+	}
+
+	/* the slot of key, or the empty slot where its probe ends */
+	size_t table::probe(const atom& key, uint64_t h) const {
+		size_t mask = slots.size() - 1;
+		uint8_t tag = (uint8_t)(h >> 57);
+		for (size_t i = h & mask;; i = (i + 1) & mask) {
+			if (ctrl[i] == empty) return i;
+			if (ctrl[i] != tag || slots[i].hash != h) continue;
+			const atom& k = slots[i].first;
+			if (eq ? eq_same(k, key) : k.bits == key.bits || iso(k, key)) return i;
+		}
+	}
+
+	atom* table::find(const atom& key) {
+		if (count == 0) return nullptr;
+		size_t i = probe(key, hash(key));
+		return ctrl[i] == empty ? nullptr : &slots[i].second;
+	}
+
+	atom& table::operator [](const atom& key) {
+		uint64_t h = hash(key);
+		size_t i;
+		if (!slots.empty()) {
+			i = probe(key, h);
+			if (ctrl[i] != empty) return slots[i].second;
+		}
+		if ((count + tombstones + 1) * 4 > slots.size() * 3) grow();
+		size_t mask = slots.size() - 1;
+		for (i = h & mask; !(ctrl[i] & 0x80); i = (i + 1) & mask) { /* the first slot not in use */
+		}
+		if (ctrl[i] == deleted) tombstones--;
+		ctrl[i] = (uint8_t)(h >> 57);
+		slots[i].hash = h;
+		slots[i].first = key;
+		count++;
+		return slots[i].second;
+	}
+
+	void table::erase(const atom& key) {
+		if (count == 0) return;
+		size_t i = probe(key, hash(key));
+		if (ctrl[i] == empty) return;
+		size_t mask = slots.size() - 1;
+		if (ctrl[(i + 1) & mask] == empty) { /* no probe goes on past it */
+			ctrl[i] = empty;
+		}
+		else {
+			ctrl[i] = deleted;
+			tombstones++;
+		}
+		slots[i].first = nil;
+		slots[i].second = nil;
+		count--;
+	}
+
+	/* doubles the slots, or keeps their number when tombstones fill them, and
+	   moves the keys by their cached hashes */
+	void table::grow() {
+		size_t size = std::max((count + 1) * 2 > slots.size() ? slots.size() * 2 : slots.size(), (size_t)8);
+		std::vector<uint8_t> old_ctrl = std::move(ctrl);
+		std::vector<slot> old_slots = std::move(slots);
+		ctrl.assign(size, empty);
+		slots = std::vector<slot>(size);
+		size_t mask = size - 1;
+		for (size_t j = 0; j < old_slots.size(); j++) {
+			if (old_ctrl[j] & 0x80) continue;
+			size_t i = old_slots[j].hash & mask;
+			while (ctrl[i] != empty) i = (i + 1) & mask;
+			ctrl[i] = old_ctrl[j];
+			slots[i] = std::move(old_slots[j]);
+		}
+	}
+
+	void table::clear() {
+		ctrl.clear();
+		slots.clear();
+		count = tombstones = 0;
+	}
+
+	/* -1, 0 or 1 as number a is less than, equal to or greater than number b, or 2 if
+	   either is NaN. An integer and a double compare exactly: a double that is not an
+	   integer of 64 bits orders by value, and any other is compared as that integer. */
+	int num_compare(const atom& a, const atom& b) {
+		bool ai = a.is_int(), bi = b.is_int();
+		if (ai && bi) {
+			int64_t x = a.integer(), y = b.integer();
+			return x < y ? -1 : x > y;
+		}
+		if (!ai && !bi) {
+			double x = a.number(), y = b.number();
+			return x < y ? -1 : x > y ? 1 : x == y ? 0 : 2;
+		}
+		int64_t i = ai ? a.integer() : b.integer();
+		double d = ai ? b.number() : a.number();
+		int c; /* i against d */
+		if (d != d) return 2;
+		if (d >= 0x1p63) c = -1;
+		else if (d < -0x1p63) c = 1;
+		else {
+			int64_t t = (int64_t)d; /* d without its fraction, which then breaks a tie */
+			c = i < t ? -1 : i > t ? 1 : d > (double)t ? -1 : d < (double)t ? 1 : 0;
+		}
+		return ai ? c : -c;
+	}
+
+	bool sorted_less(const atom& a, const atom& b) {
+		bool an = a.type() == T_NUM, bn = b.type() == T_NUM;
+		if (an != bn) return an;
+		if (an) return num_compare(a, b) == -1;
+		return a.asp<std::string>() < b.asp<std::string>();
+	}
+
+	/* can be a key of a sorted table */
+	bool sorted_key(const atom& a) {
+		return a.type() == T_STRING || (a.type() == T_NUM && a.number() == a.number());
+	}
+
+	sorted_table::entry sorted_table::entry::next() const {
+		if (i + 1 < l->n) return { l, i + 1 };
+		return { l->next, 0 };
+	}
+
+	sorted_table::entry sorted_table::entry::prev() const {
+		if (i > 0) return { l, i - 1 };
+		return { l->prev, l->prev ? l->prev->n - 1 : 0 };
+	}
+
+	/* the leaf where key is or would go */
+	sorted_table::leaf* sorted_table::find_leaf(const atom& key) const {
+		node* n = root;
+		while (n && !n->is_leaf) {
+			inner* in = (inner*)n;
+			n = in->children[std::upper_bound(in->keys, in->keys + in->n, key, sorted_less) - in->keys];
+		}
+		return (leaf*)n;
+	}
+
+	atom* sorted_table::find(const atom& key) {
+		leaf* l = find_leaf(key);
+		if (!l) return nullptr;
+		int i = std::lower_bound(l->keys, l->keys + l->n, key, sorted_less) - l->keys;
+		return i < l->n && !sorted_less(key, l->keys[i]) ? &l->values[i] : nullptr;
+	}
+
+	sorted_table::entry sorted_table::ceiling(const atom& key) const {
+		leaf* l = find_leaf(key);
+		if (!l) return { nullptr, 0 };
+		int i = std::lower_bound(l->keys, l->keys + l->n, key, sorted_less) - l->keys;
+		return i < l->n ? entry{ l, i } : entry{ l->next, 0 };
+	}
+
+	sorted_table::entry sorted_table::floor(const atom& key) const {
+		leaf* l = find_leaf(key);
+		if (!l) return { nullptr, 0 };
+		int i = std::upper_bound(l->keys, l->keys + l->n, key, sorted_less) - l->keys;
+		return i > 0 ? entry{ l, i - 1 } : entry{ l, 0 }.prev();
+	}
+
+	atom& sorted_table::operator [](const atom& key) {
+		if (!root) root = head = tail = new leaf;
+		atom* value;
+		atom sep;
+		node* right = insert(root, key, &value, &sep);
+		if (right) { /* the root split */
+			inner* in = new inner;
+			in->n = 1;
+			in->keys[0] = sep;
+			in->children[0] = root;
+			in->children[1] = right;
+			root = in;
+		}
+		return *value;
+	}
+
+	/* Adds key under n unless it is there, and points *value to its value. If n
+	   splits, returns the new node on its right, and sets *sep to the least key
+	   under it. */
+	sorted_table::node* sorted_table::insert(node* n, const atom& key, atom** value, atom* sep) {
+		if (n->is_leaf) {
+			leaf* l = (leaf*)n;
+			int i = std::lower_bound(l->keys, l->keys + l->n, key, sorted_less) - l->keys;
+			if (i < l->n && !sorted_less(key, l->keys[i])) {
+				*value = &l->values[i];
+				return nullptr;
+			}
+			count++;
+			leaf* r = nullptr;
+			if (l->n == max_keys) { /* move the upper half to a new leaf */
+				r = new leaf;
+				int half = max_keys / 2;
+				std::move(l->keys + half, l->keys + max_keys, r->keys);
+				std::move(l->values + half, l->values + max_keys, r->values);
+				r->n = max_keys - half;
+				l->n = half;
+				r->prev = l;
+				r->next = l->next;
+				(l->next ? l->next->prev : tail) = r;
+				l->next = r;
+				if (i > half) {
+					l = r;
+					i -= half;
+				}
+			}
+			std::move_backward(l->keys + i, l->keys + l->n, l->keys + l->n + 1);
+			std::move_backward(l->values + i, l->values + l->n, l->values + l->n + 1);
+			l->keys[i] = key;
+			l->values[i] = nil;
+			l->n++;
+			*value = &l->values[i];
+			if (r) *sep = r->keys[0];
+			return r;
+		}
+
+		inner* in = (inner*)n;
+		int i = std::upper_bound(in->keys, in->keys + in->n, key, sorted_less) - in->keys;
+		atom child_sep;
+		node* child = insert(in->children[i], key, value, &child_sep);
+		if (!child) return nullptr;
+		if (in->n < max_keys) {
+			std::move_backward(in->keys + i, in->keys + in->n, in->keys + in->n + 1);
+			std::move_backward(in->children + i + 1, in->children + in->n + 1, in->children + in->n + 2);
+			in->keys[i] = child_sep;
+			in->children[i + 1] = child;
+			in->n++;
+			return nullptr;
+		}
+
+		/* split: the middle key of the max_keys + 1 moves up */
+		atom keys[max_keys + 1];
+		node* children[max_keys + 2];
+		std::move(in->keys, in->keys + i, keys);
+		keys[i] = child_sep;
+		std::move(in->keys + i, in->keys + max_keys, keys + i + 1);
+		std::copy(in->children, in->children + i + 1, children);
+		children[i + 1] = child;
+		std::copy(in->children + i + 1, in->children + max_keys + 1, children + i + 2);
+		int mid = (max_keys + 1) / 2;
+		inner* r = new inner;
+		std::move(keys, keys + mid, in->keys);
+		std::copy(children, children + mid + 1, in->children);
+		in->n = mid;
+		*sep = std::move(keys[mid]);
+		std::move(keys + mid + 1, keys + max_keys + 1, r->keys);
+		std::copy(children + mid + 1, children + max_keys + 2, r->children);
+		r->n = max_keys - mid;
+		return r;
+	}
+
+	void sorted_table::erase(const atom& key) {
+		if (root && remove(root, key)) root = nullptr;
+		while (root && !root->is_leaf && root->n == 0) { /* a root with one child */
+			inner* in = (inner*)root;
+			root = in->children[0];
+			delete in;
+		}
+	}
+
+	/* Removes key from under n. Returns true if that empties n, which is then
+	   deleted, for its parent to drop. */
+	bool sorted_table::remove(node* n, const atom& key) {
+		if (n->is_leaf) {
+			leaf* l = (leaf*)n;
+			int i = std::lower_bound(l->keys, l->keys + l->n, key, sorted_less) - l->keys;
+			if (i == l->n || sorted_less(key, l->keys[i])) return false;
+			count--;
+			atom gone_key = l->keys[i], gone_value = l->values[i]; /* released once the leaf is consistent */
+			std::move(l->keys + i + 1, l->keys + l->n, l->keys + i);
+			std::move(l->values + i + 1, l->values + l->n, l->values + i);
+			l->n--;
+			l->keys[l->n] = nil;
+			l->values[l->n] = nil;
+			if (l->n > 0) return false;
+			(l->prev ? l->prev->next : head) = l->next;
+			(l->next ? l->next->prev : tail) = l->prev;
+			delete l;
+			return true;
+		}
+
+		inner* in = (inner*)n;
+		int i = std::upper_bound(in->keys, in->keys + in->n, key, sorted_less) - in->keys;
+		if (!remove(in->children[i], key)) return false;
+		if (in->n == 0) { /* its only child is gone */
+			delete in;
+			return true;
+		}
+		/* drop the child and the key between it and a neighbour */
+		int k = i > 0 ? i - 1 : 0;
+		std::move(in->keys + k + 1, in->keys + in->n, in->keys + k);
+		std::copy(in->children + i + 1, in->children + in->n + 1, in->children + i);
+		in->n--;
+		in->keys[in->n] = nil;
+		return false;
+	}
+
+	void sorted_table::destroy(node* n) {
+		if (n->is_leaf) {
+			delete (leaf*)n;
+			return;
+		}
+		inner* in = (inner*)n;
+		for (int i = 0; i <= in->n; i++) destroy(in->children[i]);
+		delete in;
+	}
+
+	void sorted_table::clear() {
+		node* n = root;
+		root = head = tail = nullptr;
+		count = 0;
+		if (n) destroy(n); /* after the table is empty, in case a release reaches it */
+	}
+
+	bool utf8_cont(char c) {
+		return ((unsigned char)c & 0xC0) == 0x80;
+	}
+
+	/* appends code point c in UTF-8 */
+	void utf8_append(std::string& s, uint32_t c) {
+		if (c < 0x80) s += (char)c;
+		else if (c < 0x800) {
+			s += (char)(0xC0 | c >> 6);
+			s += (char)(0x80 | (c & 0x3F));
+		}
+		else if (c < 0x10000) {
+			s += (char)(0xE0 | c >> 12);
+			s += (char)(0x80 | (c >> 6 & 0x3F));
+			s += (char)(0x80 | (c & 0x3F));
+		}
+		else {
+			s += (char)(0xF0 | (c >> 18 & 0x07));
+			s += (char)(0x80 | (c >> 12 & 0x3F));
+			s += (char)(0x80 | (c >> 6 & 0x3F));
+			s += (char)(0x80 | (c & 0x3F));
+		}
+	}
+
+	/* Decodes the code point at byte i of n bytes read by at(j), which runs to
+	   the next byte that is not a continuation byte, and sets *next to that
+	   byte. A malformed one is U+FFFD. */
+	template <typename At>
+	uint32_t utf8_decode(At at, size_t i, size_t n, size_t* next) {
+		unsigned char b = at(i);
+		size_t j = i + 1;
+		while (j < n && utf8_cont(at(j))) j++;
+		*next = j;
+		size_t need = b < 0x80 ? 1 : b < 0xC0 ? 0 : b < 0xE0 ? 2 : b < 0xF0 ? 3 : b < 0xF8 ? 4 : 0;
+		if (need != j - i) return 0xFFFD;
+		if (need == 1) return b;
+		uint32_t c = b & (0x7F >> need);
+		for (size_t k = i + 1; k < j; k++) c = c << 6 | ((unsigned char)at(k) & 0x3F);
+		return c;
+	}
+
+	size_t string_object::length() {
+		if (chars == SIZE_MAX) count();
+		return chars;
+	}
+
+	void string_object::count() {
+		chars = 0;
+		index.clear();
+		for (size_t i = 0; i < value.size(); i++) {
+			if (i > 0 && utf8_cont(value[i])) continue;
+			if (chars % index_step == 0) index.push_back(i);
+			chars++;
+		}
+		if (chars == value.size()) {
+			index.clear();
+			index.shrink_to_fit();
+		}
+	}
+
+	size_t string_object::offset(size_t i) {
+		if (length() == value.size()) return i;
+		size_t p = index[i / index_step];
+		for (size_t k = i % index_step; k > 0; k--) {
+			p++;
+			while (utf8_cont(value[p])) p++;
+		}
+		return p;
+	}
+
+	void string_object::changed() {
+		chars = SIZE_MAX;
+		index.clear();
+	}
+
+	void rope::append(std::string_view s) {
+		while (!s.empty()) {
+			if (chunks.empty() || chunks.back().size() == chunk_size) {
+				starts.push_back(count);
+				chunks.emplace_back();
+				if (chunks.size() > 1) chunks.back().reserve(chunk_size);
+			}
+			std::string& c = chunks.back();
+			size_t n = std::min(s.size(), chunk_size - c.size());
+			for (size_t i = 0; i < n; i++) {
+				if (!utf8_cont(s[i]) || length + i == 0) count++;
+			}
+			c.append(s.data(), n);
+			length += n;
+			s.remove_prefix(n);
+		}
+	}
+
+	uint32_t rope::char_at(size_t i) const {
+		size_t p = i;
+		if (count != length) {
+			size_t k = std::upper_bound(starts.begin(), starts.end(), i) - starts.begin() - 1;
+			size_t seen = starts[k];
+			for (p = k * chunk_size;; p++) {
+				if (p > 0 && utf8_cont((*this)[p])) continue;
+				if (seen == i) break;
+				seen++;
+			}
+		}
+		size_t next;
+		return utf8_decode([this](size_t j) { return (*this)[j]; }, p, length, &next);
+	}
+
+	std::string rope::str() const {
+		std::string s;
+		s.reserve(length);
+		for (auto& c : chunks) s += c;
+		return s;
+	}
+
+	int popcount(uint32_t x) {
+#ifdef _MSC_VER
+		return __popcnt(x);
+#else
+		return __builtin_popcount(x);
+#endif
+	}
+
+	bool same_key(const atom& a, const atom& b) {
+		return a.bits == b.bits || iso(a, b);
+	}
+
+	hamt& hamt::operator =(const hamt& b) {
+		if (b.root) b.root->refs++;
+		release(root);
+		root = b.root;
+		count = b.count;
+		return *this;
+	}
+
+	void hamt::release(node* n) {
+		if (!n || --n->refs > 0) return;
+		for (auto c : n->children) release(c);
+		delete n;
+	}
+
+	/* n, copied first if another node or map holds it too */
+	hamt::node* hamt::own(node*& n) {
+		if (n->refs == 1) return n;
+		node* c = new node;
+		c->datamap = n->datamap;
+		c->nodemap = n->nodemap;
+		c->entries = n->entries;
+		c->children = n->children;
+		for (auto k : c->children) k->refs++;
+		n->refs--;
+		return n = c;
+	}
+
+	const atom* hamt::find(const atom& key) const {
+		uint64_t h = mix_hash(hash_atom(key));
+		const node* n = root;
+		for (int shift = 0; n; shift += 5) {
+			if (shift >= 64) {
+				for (auto& e : n->entries) {
+					if (same_key(e.first, key)) return &e.second;
+				}
+				return nullptr;
+			}
+			uint32_t bit = 1u << (h >> shift & 31);
+			if (n->datamap & bit) {
+				auto& e = n->entries[popcount(n->datamap & (bit - 1))];
+				return same_key(e.first, key) ? &e.second : nullptr;
+			}
+			if (!(n->nodemap & bit)) return nullptr;
+			n = n->children[popcount(n->nodemap & (bit - 1))];
+		}
+		return nullptr;
+	}
+
+	/* sets key in the trie n at the level of shift, and tells whether it is new */
+	bool hamt::insert(node*& p, int shift, uint64_t h, const atom& key, const atom& value) {
+		if (!p) p = new node;
+		node* n = own(p);
+		if (shift >= 64) { /* collision node */
+			for (auto& e : n->entries) {
+				if (same_key(e.first, key)) {
+					e.second = value;
+					return false;
+				}
+			}
+			n->entries.emplace_back(key, value);
+			return true;
+		}
+		uint32_t bit = 1u << (h >> shift & 31);
+		if (n->datamap & bit) {
+			auto i = n->entries.begin() + popcount(n->datamap & (bit - 1));
+			if (same_key(i->first, key)) {
+				i->second = value;
+				return false;
+			}
+			/* both keys go down to a new child */
+			node* c = nullptr;
+			insert(c, shift + 5, mix_hash(hash_atom(i->first)), i->first, i->second);
+			insert(c, shift + 5, h, key, value);
+			n->entries.erase(i);
+			n->datamap ^= bit;
+			n->children.insert(n->children.begin() + popcount(n->nodemap & (bit - 1)), c);
+			n->nodemap |= bit;
+			return true;
+		}
+		if (n->nodemap & bit) return insert(n->children[popcount(n->nodemap & (bit - 1))], shift + 5, h, key, value);
+		n->entries.insert(n->entries.begin() + popcount(n->datamap & (bit - 1)), std::make_pair(key, value));
+		n->datamap |= bit;
+		return true;
+	}
+
+	/* removes key, which is in the trie n at the level of shift. A child left
+	   with a single entry gives it back to its parent, so that every map of the
+	   same keys has the same shape. */
+	void hamt::remove(node*& p, int shift, uint64_t h, const atom& key) {
+		node* n = own(p);
+		if (shift >= 64) {
+			for (auto i = n->entries.begin(); i != n->entries.end(); ++i) {
+				if (same_key(i->first, key)) {
+					n->entries.erase(i);
+					return;
+				}
+			}
+			return;
+		}
+		uint32_t bit = 1u << (h >> shift & 31);
+		if (n->datamap & bit) {
+			n->entries.erase(n->entries.begin() + popcount(n->datamap & (bit - 1)));
+			n->datamap ^= bit;
+			return;
+		}
+		auto i = n->children.begin() + popcount(n->nodemap & (bit - 1));
+		remove(*i, shift + 5, h, key);
+		node* c = *i;
+		if (c->nodemap == 0 && c->entries.size() == 1) {
+			n->entries.insert(n->entries.begin() + popcount(n->datamap & (bit - 1)), c->entries[0]);
+			n->datamap |= bit;
+			n->children.erase(i);
+			n->nodemap ^= bit;
+			release(c);
+		}
+	}
+
+	void hamt::set(const atom& key, const atom& value) {
+		if (insert(root, 0, mix_hash(hash_atom(key)), key, value)) count++;
+	}
+
+	bool hamt::erase(const atom& key) {
+		if (!find(key)) return false;
+		remove(root, 0, mix_hash(hash_atom(key)), key);
+		count--;
+		if (count == 0) clear();
+		return true;
+	}
+
+	void hamt::clear() {
+		node* n = root;
+		root = nullptr;
+		count = 0;
+		release(n); /* after the map is empty, in case a release reaches it */
+	}
+
+	object::object(enum type kind) : index(heap_objects.size()), kind(kind) {
+		if (heap_objects.size() >= max_objects) throw std::bad_alloc();
+		heap_objects.push_back(this);
+	}
+
+	object::~object() {
+		struct object* last = heap_objects.back();
+		last->index = index;
+		heap_objects[index] = last;
+		heap_objects.pop_back();
+	}
+
+	void free_object(struct object* o) {
+		switch (o->kind) {
+		case T_CONS:
+			delete (struct cons*)o;
+			break;
+		case T_CLOSURE:
+			delete (struct closure*)o;
+			break;
+		case T_STRING:
+			delete (struct string_object*)o;
+			break;
+		case T_TABLE:
+			delete (struct table_object*)o;
+			break;
+		case T_VECTOR:
+			delete (struct vector_object*)o;
+			break;
+		case T_F64ARRAY:
+			delete (struct f64array_object*)o;
+			break;
+		case T_SORTED_TABLE:
+			delete (struct sorted_table_object*)o;
+			break;
+		case T_IMAP:
+			delete (struct imap_object*)o;
+			break;
+		case T_STRBUF:
+			delete (struct strbuf_object*)o;
+			break;
+		case T_NUM:
+			delete (struct int_object*)o;
+			break;
+		default:
+			break;
+		}
+	}
+
+	/* Frees up to budget queued objects. An object released while another is
+	   freed is queued, so that long lists and deep structures are freed
+	   without recursion, and a step at a time. */
+	void free_pending(size_t budget) {
+		freeing = true;
+		for (; budget > 0 && !free_queue.empty(); budget--) {
+			struct object* o = free_queue.back();
+			free_queue.pop_back();
+			free_object(o);
+		}
+		freeing = false;
+	}
+
+	/* queues the object of the last atom pointing to it */
+	void atom::destroy() {
+		free_queue.push_back(obj());
+		if (!freeing) free_pending(free_step);
+	}
+
 	atom make_cons(const atom& car_val, const atom& cdr_val)
 	{
-		atom a;
-		a.type = T_CONS;
-		a.val = std::make_shared<cons>(car_val, cdr_val);
-		return a;
+		return atom(T_CONS, new cons(car_val, cdr_val));
 	}
 
 	atom make_number(double x)
 	{
 		atom a;
-		a.type = T_NUM;
-		a.val = x;
+		if (x != x) { /* every NaN becomes the one that is not a tag */
+			a.bits = 0x7FF8000000000000;
+		}
+		else if (x >= -0x1p47 && x < 0x1p47 && x == (double)(int64_t)x && (x != 0 || !signbit(x))) {
+			/* a double that is an integer in 48 bits becomes the integer, so that
+			   such a number has one form */
+			a.bits = TAG_FIXNUM << 48 | ((uint64_t)(int64_t)x & payload_mask);
+		}
+		else {
+			memcpy(&a.bits, &x, sizeof(x));
+		}
 		return a;
 	}
 
-	atom make_sym(const std::string& s)
+	atom make_int(int64_t x)
 	{
+		if (x < -((int64_t)1 << 47) || x >= (int64_t)1 << 47) return atom(T_NUM, new int_object(x));
 		atom a;
-		a.type = T_SYM;
+		a.bits = TAG_FIXNUM << 48 | ((uint64_t)x & payload_mask);
+		return a;
+	}
+
+	/* x, which has no fraction, as an integer when one holds it */
+	atom make_integral(double x)
+	{
+		if (x >= -0x1p63 && x < 0x1p63) return make_int((int64_t)x);
+		return make_number(x);
+	}
+
+	/* the integer at the start of s; one too big for 64 bits becomes a double */
+	atom parse_int(const char* s)
+	{
+		errno = 0;
+		long long i = strtoll(s, nullptr, 10);
+		if (errno == ERANGE) return make_integral(trunc(strtod(s, nullptr)));
+		return make_int(i);
+	}
+
+	/* *r = a + b, unless that overflows */
+	bool add_int(int64_t a, int64_t b, int64_t* r) {
+#ifdef _MSC_VER
+		if (b > 0 ? a > INT64_MAX - b : a < INT64_MIN - b) return false;
+		*r = a + b;
+		return true;
+#else
+		return !__builtin_add_overflow(a, b, r);
+#endif
+	}
+
+	bool sub_int(int64_t a, int64_t b, int64_t* r) {
+#ifdef _MSC_VER
+		if (b < 0 ? a > INT64_MAX + b : a < INT64_MIN + b) return false;
+		*r = a - b;
+		return true;
+#else
+		return !__builtin_sub_overflow(a, b, r);
+#endif
+	}
+
+	bool mul_int(int64_t a, int64_t b, int64_t* r) {
+#ifdef _MSC_VER
+		int64_t high;
+		int64_t low = _mul128(a, b, &high);
+		if (high != (low >> 63)) return false;
+		*r = low;
+		return true;
+#else
+		return !__builtin_mul_overflow(a, b, r);
+#endif
+	}
 
+	atom make_sym(std::string_view s)
+	{
 		auto found = sym_of_str.find(s);
 		if (found != sym_of_str.end()) {
-			a.val = found->second;
-			return a;
+			return atom(T_SYM, (uint64_t)found->second);
 		}
 
 		// new symbol
-		int id = sym_of_str.size();
-		a.val = id;
-		sym_of_str[s] = id;
-		str_of_sym[id] = s;
-		return a;
+		sym id = str_of_sym.size();
+		std::string_view name = sym_names.add(s);
+		sym_of_str.emplace(name, id);
+		str_of_sym.push_back(name);
+		return atom(T_SYM, (uint64_t)id);
 	}
 
-	atom make_builtin(builtin fn)
+	/* a new symbol, named when its name is first needed */
+	atom make_uniq()
 	{
-		atom a;
-		a.type = T_BUILTIN;
-		a.val = fn;
-		return a;
+		sym id = str_of_sym.size();
+		str_of_sym.emplace_back();
+		return atom(T_SYM, (uint64_t)id);
 	}
 
-	error make_closure(const std::shared_ptr<struct env>& env, atom args, atom body, atom* result)
+	std::string_view sym_name(sym s)
 	{
-		atom p;
-
-		if (!listp(body))
-			return ERROR_SYNTAX;
-
-		/* Check argument names are all symbols or conses */
-		p = args;
-		while (!no(p)) {
-			if (p.type == T_SYM)
-				break;
-			else if (p.type != T_CONS || (car(p).type != T_SYM && car(p).type != T_CONS))
-				return ERROR_TYPE;
-			p = cdr(p);
+		std::string_view& name = str_of_sym[s];
+		if (!name.data()) { /* uniq */
+			std::string n;
+			do {
+				n = "_uniq" + std::to_string(++uniq_count);
+			} while (sym_of_str.count(n));
+			name = sym_names.add(n);
+			sym_of_str.emplace(name, s);
 		}
+		return name;
+	}
 
-		result->type = T_CLOSURE;
-		result->val = std::make_shared<struct closure>(env, args, body);
+	atom make_builtin(builtin fn)
+	{
+		return atom(T_BUILTIN, (uint64_t)(uintptr_t)fn);
+	}
 
+	error make_closure(const env_ptr& env, const lambda_ptr& fn, atom* result)
+	{
+		*result = atom(T_CLOSURE, new struct closure(env, fn));
 		return ERROR_OK;
 	}
 
-	atom make_string(const std::string& x)
+	atom make_string(std::string x)
 	{
-		atom a;
-		a.type = T_STRING;
-		a.val = std::make_shared<std::string>(x);
-		return a;
+		return atom(T_STRING, new string_object(std::move(x)));
 	}
 
 	atom make_input(FILE* fp) {
-		atom a;
-		a.type = T_INPUT;
-		a.val = fp;
-		return a;
+		return atom(T_INPUT, (uint64_t)(uintptr_t)fp);
 	}
 
 	atom make_input_pipe(FILE* fp) {
-		atom a;
-		a.type = T_INPUT_PIPE;
-		a.val = fp;
-		return a;
+		return atom(T_INPUT_PIPE, (uint64_t)(uintptr_t)fp);
 	}
 
 	atom make_output(FILE* fp) {
-		atom a;
-		a.type = T_OUTPUT;
-		a.val = fp;
-		return a;
+		return atom(T_OUTPUT, (uint64_t)(uintptr_t)fp);
 	}
 
-	atom make_char(char c) {
-		atom a;
-		a.type = T_CHAR;
-		a.val = c;
-		return a;
+	atom make_char(uint32_t c) {
+		return atom(T_CHAR, (uint64_t)c);
 	}
 
 	void print_expr(const atom& a)
@@ -181,6 +1004,8 @@ namespace arc {
 
 		if (strchr(prefix, str[0]) != NULL)
 			*end = str + 1;
+		else if (str[0] == '#' && str[1] == '(') /* vector */
+			*end = str + 2;
 		else if (str[0] == ',')
 			*end = str + (str[1] == '@' ? 2 : 1);
 		else if (str[0] == '"') {
@@ -209,14 +1034,21 @@ namespace arc {
 	{
 		char* p;
 
-		/* Is it a number? */
+		/* Is it an integer, or another number? */
+		if (isdigit((unsigned char)start[0]) || ((start[0] == '-' || start[0] == '+') && isdigit((unsigned char)start[1]))) {
+			errno = 0;
+			long long i = strtoll(start, &p, 10);
+			if (p == end && errno == 0) {
+				*result = make_int(i);
+				return ERROR_OK;
+			}
+		}
 		double val = strtod(start, &p);
 		if (p == end) {
 			*result = make_number(val);
 			return ERROR_OK;
 		}
 		else if (start[0] == '"') { /* "string" */
-			result->type = T_STRING;
 			size_t length = end - start - 2;
 			char* buf = (char*)malloc(length + 1);
 			const char* ps = start + 1;
@@ -256,8 +1088,10 @@ namespace arc {
 			memcpy(buf, start, end - start);
 			buf[end - start] = 0;
 			size_t length = end - start;
-			if (length == 3 && buf[1] == '\\') { /* plain character e.g. #\a */
-				*result = make_char(buf[2]);
+			size_t next;
+			uint32_t plain = length >= 3 && buf[1] == '\\' ? utf8_decode([buf](size_t i) { return buf[i]; }, 2, length, &next) : 0;
+			if (length >= 3 && buf[1] == '\\' && next == length) { /* plain character e.g. #\a */
+				*result = make_char(plain);
 				free(buf);
 				return ERROR_OK;
 			}
@@ -284,7 +1118,16 @@ namespace arc {
 		}
 
 		/* NIL or symbol */
-		char* buf = (char*)malloc(end - start + 1);
+		std::string_view token(start, end - start);
+		if (token.find_first_of(".!:") == std::string_view::npos && !(token.size() >= 2 && token[0] == '~')) {
+			/* no syntax sugar: intern it from the input */
+			if (token == "nil")
+				*result = nil;
+			else
+				*result = make_sym(token);
+			return ERROR_OK;
+		}
+		char* buf = (char*)malloc(end - start + 1);
 		memcpy(buf, start, end - start);
 		buf[end - start] = 0;
 
@@ -480,6 +1323,14 @@ namespace arc {
 		if (token[0] == '(') {
 			return read_list(*end, end, result);
 		}
+		else if (token[0] == '#' && token[1] == '(') { /* #(...) => vector */
+			atom list;
+			err = read_list(*end, end, &list);
+			if (err) return err;
+			if (!listp(list)) return ERROR_SYNTAX;
+			*result = make_vector(atom_to_vector(list));
+			return ERROR_OK;
+		}
 		else if (token[0] == ')')
 			return ERROR_SYNTAX;
 		else if (token[0] == '[') {
@@ -540,49 +1391,44 @@ namespace arc {
 		return (char*)realloc(str, sizeof(char) * len);
 	}
 
-	error env_get(std::shared_ptr<struct env> env, sym symbol, atom* result)
-	{
-		while (1) {
-			auto& tbl = env->table;
-			auto found = tbl.find(symbol);
-			if (found != tbl.end()) {
-				*result = found->second;
-				return ERROR_OK;
+	/* returns the cell of a global variable, creating an unbound one if needed */
+	struct cell* global_cell(sym s) {
+		while (global_cells.size() <= (size_t)s) {
+			global_cells.emplace_back();
+			global_cells.back().name = atom(T_SYM, (uint64_t)(global_cells.size() - 1));
+		}
+		return &global_cells[s];
+	}
+
+	error global_get(struct cell* c, atom* result) {
+		if (!c->bound) {
+			if (c->unit) { /* defined on first use */
+				error err = image_load_unit(c->unit - 1);
+				if (err) {
+					err_expr = c->name;
+					return err;
+				}
 			}
-			env = env->parent;
-			if (env == nullptr) {
-				/*printf("%s: ", symbol.p.symbol);*/
+			if (!c->bound) {
+				err_expr = c->name;
 				return ERROR_UNBOUND;
 			}
 		}
-	}
-
-	error env_assign(const std::shared_ptr<struct env>& env, sym symbol, const atom &value) {
-		auto& tbl = env->table;
-		tbl[symbol] = value;
+		*result = c->value;
 		return ERROR_OK;
 	}
 
-	error env_assign_eq(std::shared_ptr<struct env> env, sym symbol, const atom &value) {
-		while (1) {
-			auto& tbl = env->table;
-			auto found = tbl.find(symbol);
-			if (found != tbl.end()) {
-				found->second = value;
-				return ERROR_OK;
-			}
-			auto& parent = env->parent;
-			if (parent == nullptr) {
-				return env_assign(env, symbol, value);
-			}
-			env = parent;
-		}
+	void global_set(struct cell* c, const atom& value) {
+		c->value = value;
+		c->bound = true;
+		c->version++;
+		c->unit = 0; /* a definition from an image must not replace it */
 	}
 
 	int listp(atom expr)
 	{
 		while (!no(expr)) {
-			if (expr.type != T_CONS)
+			if (expr.type() != T_CONS)
 				return 0;
 			expr = cdr(expr);
 		}
@@ -592,7 +1438,7 @@ namespace arc {
 	size_t len(atom expr) {
 		size_t ret = 0;
 		while (!no(expr)) {
-			if (expr.type != T_CONS)
+			if (expr.type() != T_CONS)
 				return ret + 1;
 			expr = cdr(expr);
 			ret++;
@@ -615,7 +1461,7 @@ namespace arc {
 			cdr(p) = make_cons(car(list), nil);
 			p = cdr(p);
 			list = cdr(list);
-			if (list.type != T_CONS) { /* improper list */
+			if (list.type() != T_CONS) { /* improper list */
 				p = list;
 				break;
 			}
@@ -624,33 +1470,43 @@ namespace arc {
 		return a;
 	}
 
-	error destructuring_bind(atom arg_name, atom val, int val_unspecified, const std::shared_ptr<struct env>& env) {
-		switch (arg_name.type) {
-		case T_SYM:
-			return env_assign(env, std::get<sym>(arg_name.val), val);
-		case T_CONS:
-			if (is(car(arg_name), sym_o)) { /* (o ARG [DEFAULT]) */
-				if (val_unspecified) { /* missing argument */
-					if (!no(cdr(cdr(arg_name)))) {
-						error err = eval_expr(car(cdr(cdr(arg_name))), env, &val);
-						if (err) {
-							return err;
+	error destructuring_bind(const struct pattern* pat, atom val, int val_unspecified, const env_ptr& env) {
+		switch (pat->type) {
+		case PAT_VAR:
+			env->slots[pat->slot] = val;
+			return ERROR_OK;
+		case PAT_OPT:
+			if (val_unspecified) { /* missing argument */
+				if (pat->dflt) {
+					error err;
+					if (use_vm) {
+						if (!pat->compiled) {
+							pat->compiled = std::make_unique<struct chunk>();
+							compile(pat->dflt.get(), pat->compiled.get());
 						}
+						err = vm_run(pat->compiled.get(), env, &val);
+					}
+					else {
+						err = eval_node(pat->dflt.get(), env, &val);
+					}
+					if (err) {
+						return err;
 					}
 				}
-				return env_assign(env, std::get<sym>(car(cdr(arg_name)).val), val);
 			}
-			else {
-				if (val.type != T_CONS) {
-					return ERROR_ARGS;
-				}
-				error err = destructuring_bind(car(arg_name), car(val), 0, env);
-				if (err) {
-					return err;
-				}
-				return destructuring_bind(cdr(arg_name), cdr(val), no(cdr(val)), env);
+			env->slots[pat->slot] = val;
+			return ERROR_OK;
+		case PAT_CONS: {
+			if (val.type() != T_CONS) {
+				return ERROR_ARGS;
 			}
-		case T_NIL:
+			error err = destructuring_bind(pat->car.get(), car(val), 0, env);
+			if (err) {
+				return err;
+			}
+			return destructuring_bind(pat->cdr.get(), cdr(val), no(cdr(val)), env);
+		}
+		case PAT_NIL:
 			if (no(val))
 				return ERROR_OK;
 			else {
@@ -661,73 +1517,100 @@ namespace arc {
 		}
 	}
 
-	error env_bind(const std::shared_ptr<struct env>& env, atom arg_names, const std::vector<atom>& vargs) {
+	error env_bind(const env_ptr& env, const struct lambda& fn, const atom* vargs, size_t count) {
 		size_t i = 0;
-		while (!no(arg_names)) {
-			if (arg_names.type == T_SYM) {
-				env_assign(env, std::get<sym>(arg_names.val), vector_to_atom(vargs, i));
-				i = vargs.size();
+		if (fn.arity >= 0) { /* plain symbols */
+			for (; i < count && i < (size_t)fn.arity; i++) {
+				env->slots[i] = vargs[i];
+			}
+			return i < count ? ERROR_ARGS : ERROR_OK;
+		}
+		const struct pattern* pat = fn.params.get();
+		while (pat->type != PAT_NIL) {
+			if (pat->type == PAT_VAR) { /* rest parameter */
+				atom rest = nil;
+				size_t j;
+				for (j = count; j > i; j--) {
+					rest = make_cons(vargs[j - 1], rest);
+				}
+				env->slots[pat->slot] = rest;
+				i = count;
 				break;
 			}
-			atom arg_name = car(arg_names);
 			atom val;
 			int val_unspecified = 0;
-			if (i < vargs.size()) {
+			if (i < count) {
 				val = vargs[i];
 			}
 			else {
 				val_unspecified = 1;
 			}
-			error err = destructuring_bind(arg_name, val, val_unspecified, env);
+			error err = destructuring_bind(pat->car.get(), val, val_unspecified, env);
 			if (err) {
 				return err;
 			}
-			arg_names = cdr(arg_names);
+			pat = pat->cdr.get();
 			i++;
 		}
-		if (i < vargs.size())
+		if (i < count)
 			return ERROR_ARGS;
 		return ERROR_OK;
 	}
 
+	error env_bind(const env_ptr& env, const struct lambda& fn, const std::vector<atom>& vargs) {
+		return env_bind(env, fn, vargs.data(), vargs.size());
+	}
+
+	/* A safe point inside a running form, taken at each closure call and so at
+	   each turn of a loop. The collectors it starts find the roots from counts. */
+	inline void gc_poll() {
+		if (cycle_candidates.size() >= cycle_poll_at || heap_objects.size() >= gc_threshold) gc_poll_collect();
+	}
+
 	error apply(const atom& fn, const std::vector<atom>& vargs, atom* result)
 	{
-		if (fn.type == T_BUILTIN)
-			return std::get<builtin>(fn.val)(vargs, result);
-		else if (fn.type == T_CLOSURE) {
-			struct closure cls = *std::get<std::shared_ptr<struct closure>>(fn.val);
-			std::shared_ptr<struct env> env = std::make_shared<struct env>(cls.parent_env);
-			atom arg_names = cls.args;
-			atom body = cls.body;
+		if (fn.type() == T_BUILTIN)
+			return fn.fn()(vargs, result);
+		else if (fn.type() == T_CLOSURE) {
+			gc_poll();
+			if (use_vm)
+				return vm_apply(fn, vargs, result);
+			const struct closure& cls = fn.asp<struct closure>();
+			env_ptr env = make_env(cls.parent_env, cls.fn->frame_size);
 
 			/* Bind the arguments */
-			env_bind(env, arg_names, vargs);
+			env_bind(env, *cls.fn, vargs);
 
 			/* Evaluate the body */
 			*result = nil;
-			while (!no(body)) {
-				error err = eval_expr(car(body), env, result);
+			for (auto& n : cls.fn->code) {
+				error err = eval_node(n.get(), env, result);
 				if (err)
 					return err;
-				body = cdr(body);
 			}
 
 			return ERROR_OK;
 		}
-		else if (fn.type == T_CONTINUATION) {
+		else if (fn.type() == T_CONTINUATION) {
 			if (vargs.size() != 1) return ERROR_ARGS;
 			thrown = vargs[0];
-			longjmp(*std::get<jmp_buf*>(fn.val), 1);
+			longjmp(*fn.continuation(), 1);
 		}
-		else if (fn.type == T_STRING) { /* implicit indexing for string */
+		else if (fn.type() == T_STRING) { /* implicit indexing for string, by code point */
 			if (vargs.size() != 1) return ERROR_ARGS;
-			long index = (long)(std::get<double>(vargs[0].val));
-			*result = make_char(fn.asp<std::string>()[index]);
+			if (vargs[0].type() != T_NUM) return ERROR_TYPE;
+			auto o = (struct string_object*)fn.obj();
+			double index = vargs[0].number();
+			if (!(index >= 0 && index < o->length())) return ERROR_RANGE;
+			size_t next;
+			const std::string& v = o->value;
+			*result = make_char(utf8_decode([&v](size_t i) { return v[i]; }, o->offset((size_t)index), v.size(), &next));
 			return ERROR_OK;
 		}
-		else if (fn.type == T_CONS && listp(fn)) { /* implicit indexing for list */
+		else if (fn.type() == T_CONS && listp(fn)) { /* implicit indexing for list */
 			if (vargs.size() != 1) return ERROR_ARGS;
-			long index = (long)(std::get<double>(vargs[0].val));
+			if (vargs[0].type() != T_NUM) return ERROR_TYPE;
+			long index = (long)(vargs[0].number());
 			atom a = fn;
 			long i;
 			for (i = 0; i < index; i++) {
@@ -740,14 +1623,54 @@ namespace arc {
 			*result = car(a);
 			return ERROR_OK;
 		}
-		else if (fn.type == T_TABLE) { /* implicit indexing for table */
+		else if (fn.type() == T_VECTOR) { /* implicit indexing for vector */
+			if (vargs.size() != 1) return ERROR_ARGS;
+			if (vargs[0].type() != T_NUM) return ERROR_TYPE;
+			auto& v = fn.asp<std::vector<atom>>();
+			double index = vargs[0].number();
+			if (!(index >= 0 && index < v.size())) return ERROR_RANGE;
+			*result = v[(size_t)index];
+			return ERROR_OK;
+		}
+		else if (fn.type() == T_F64ARRAY) { /* implicit indexing for f64array */
+			if (vargs.size() != 1) return ERROR_ARGS;
+			if (vargs[0].type() != T_NUM) return ERROR_TYPE;
+			auto& v = fn.asp<std::vector<double>>();
+			double index = vargs[0].number();
+			if (!(index >= 0 && index < v.size())) return ERROR_RANGE;
+			*result = make_number(v[(size_t)index]);
+			return ERROR_OK;
+		}
+		else if (fn.type() == T_SORTED_TABLE) { /* implicit indexing for sorted table */
+			long len1 = vargs.size();
+			if (len1 != 1 && len1 != 2) return ERROR_ARGS;
+			if (!sorted_key(vargs[0])) return ERROR_TYPE;
+			atom* found = fn.asp<sorted_table>().find(vargs[0]);
+			*result = found ? *found : len1 == 2 ? vargs[1] : nil;
+			return ERROR_OK;
+		}
+		else if (fn.type() == T_STRBUF) { /* implicit indexing for strbuf */
+			if (vargs.size() != 1) return ERROR_ARGS;
+			if (vargs[0].type() != T_NUM) return ERROR_TYPE;
+			auto& r = fn.asp<rope>();
+			double index = vargs[0].number();
+			if (!(index >= 0 && index < r.chars())) return ERROR_RANGE;
+			*result = make_char(r.char_at((size_t)index));
+			return ERROR_OK;
+		}
+		else if (fn.type() == T_IMAP) { /* implicit indexing for imap */
+			long len1 = vargs.size();
+			if (len1 != 1 && len1 != 2) return ERROR_ARGS;
+			const atom* found = fn.asp<hamt>().find(vargs[0]);
+			*result = found ? *found : len1 == 2 ? vargs[1] : nil;
+			return ERROR_OK;
+		}
+		else if (fn.type() == T_TABLE) { /* implicit indexing for table */
 			long len1 = vargs.size();
 			if (len1 != 1 && len1 != 2) return ERROR_ARGS;
-			atom key = vargs[0];
-			auto& tbl = *std::get<std::shared_ptr<table>>(fn.val);
-			auto found = tbl.find(key);
-			if (found != tbl.end()) {
-				*result = found->second;
+			atom* found = fn.asp<table>().find(vargs[0]);
+			if (found) {
+				*result = *found;
 			}
 			else {
 				if (len1 == 2) /* default value is specified */
@@ -771,7 +1694,7 @@ namespace arc {
 		atom a = vargs[0];
 		if (no(a))
 			*result = nil;
-		else if (a.type != T_CONS)
+		else if (a.type() != T_CONS)
 			return ERROR_TYPE;
 		else
 			*result = car(a);
@@ -787,7 +1710,7 @@ namespace arc {
 		atom a = vargs[0];
 		if (no(a))
 			*result = nil;
-		else if (a.type != T_CONS)
+		else if (a.type() != T_CONS)
 			return ERROR_TYPE;
 		else
 			*result = cdr(a);
@@ -821,9 +1744,173 @@ namespace arc {
 		return nil;
 	}
 
+	/* f64array kernels. f64x is the widest vector of doubles the target has,
+	   or a single double; the kernels finish the remainder with scalars. */
+#if defined(__AVX__)
+	typedef __m256d f64x;
+	const size_t f64x_width = 4;
+	inline f64x f64x_load(const double* p) { return _mm256_loadu_pd(p); }
+	inline void f64x_store(double* p, f64x x) { _mm256_storeu_pd(p, x); }
+	inline f64x f64x_set1(double x) { return _mm256_set1_pd(x); }
+	inline f64x f64x_add(f64x a, f64x b) { return _mm256_add_pd(a, b); }
+	inline f64x f64x_sub(f64x a, f64x b) { return _mm256_sub_pd(a, b); }
+	inline f64x f64x_mul(f64x a, f64x b) { return _mm256_mul_pd(a, b); }
+	inline f64x f64x_div(f64x a, f64x b) { return _mm256_div_pd(a, b); }
+	inline f64x f64x_min(f64x a, f64x b) { return _mm256_min_pd(a, b); }
+	inline f64x f64x_max(f64x a, f64x b) { return _mm256_max_pd(a, b); }
+	inline f64x f64x_sqrt(f64x a) { return _mm256_sqrt_pd(a); }
+#elif defined(__SSE2__) || defined(_M_X64)
+	typedef __m128d f64x;
+	const size_t f64x_width = 2;
+	inline f64x f64x_load(const double* p) { return _mm_loadu_pd(p); }
+	inline void f64x_store(double* p, f64x x) { _mm_storeu_pd(p, x); }
+	inline f64x f64x_set1(double x) { return _mm_set1_pd(x); }
+	inline f64x f64x_add(f64x a, f64x b) { return _mm_add_pd(a, b); }
+	inline f64x f64x_sub(f64x a, f64x b) { return _mm_sub_pd(a, b); }
+	inline f64x f64x_mul(f64x a, f64x b) { return _mm_mul_pd(a, b); }
+	inline f64x f64x_div(f64x a, f64x b) { return _mm_div_pd(a, b); }
+	inline f64x f64x_min(f64x a, f64x b) { return _mm_min_pd(a, b); }
+	inline f64x f64x_max(f64x a, f64x b) { return _mm_max_pd(a, b); }
+	inline f64x f64x_sqrt(f64x a) { return _mm_sqrt_pd(a); }
+#else
+	typedef double f64x;
+	const size_t f64x_width = 1;
+	inline f64x f64x_load(const double* p) { return *p; }
+	inline void f64x_store(double* p, f64x x) { *p = x; }
+	inline f64x f64x_set1(double x) { return x; }
+	inline f64x f64x_add(f64x a, f64x b) { return a + b; }
+	inline f64x f64x_sub(f64x a, f64x b) { return a - b; }
+	inline f64x f64x_mul(f64x a, f64x b) { return a * b; }
+	inline f64x f64x_div(f64x a, f64x b) { return a / b; }
+	inline f64x f64x_min(f64x a, f64x b) { return a < b ? a : b; }
+	inline f64x f64x_max(f64x a, f64x b) { return a > b ? a : b; }
+	inline f64x f64x_sqrt(f64x a) { return sqrt(a); }
+#endif
+
+	/* operations for the kernels, on vectors and on single doubles */
+	struct f64_add {
+		static f64x vec(f64x a, f64x b) { return f64x_add(a, b); }
+		static double one(double a, double b) { return a + b; }
+	};
+	struct f64_sub {
+		static f64x vec(f64x a, f64x b) { return f64x_sub(a, b); }
+		static double one(double a, double b) { return a - b; }
+	};
+	struct f64_mul {
+		static f64x vec(f64x a, f64x b) { return f64x_mul(a, b); }
+		static double one(double a, double b) { return a * b; }
+	};
+	struct f64_div {
+		static f64x vec(f64x a, f64x b) { return f64x_div(a, b); }
+		static double one(double a, double b) { return a / b; }
+	};
+	struct f64_min { /* like the vector instructions, returns b if either is NaN */
+		static f64x vec(f64x a, f64x b) { return f64x_min(a, b); }
+		static double one(double a, double b) { return a < b ? a : b; }
+	};
+	struct f64_max {
+		static f64x vec(f64x a, f64x b) { return f64x_max(a, b); }
+		static double one(double a, double b) { return a > b ? a : b; }
+	};
+
+	/* r[i] = op(a[i], b[i]) for i below n; a scalar operand repeats its value.
+	   r may be a or b. */
+	template <typename Op>
+	void f64_map(double* r, const double* a, bool a_scalar, const double* b, bool b_scalar, size_t n) {
+		size_t i = 0;
+		if (n >= f64x_width) {
+			f64x va = f64x_set1(*a), vb = f64x_set1(*b);
+			for (; i + f64x_width <= n; i += f64x_width) {
+				if (!a_scalar) va = f64x_load(a + i);
+				if (!b_scalar) vb = f64x_load(b + i);
+				f64x_store(r + i, Op::vec(va, vb));
+			}
+		}
+		for (; i < n; i++) r[i] = Op::one(a_scalar ? *a : a[i], b_scalar ? *b : b[i]);
+	}
+
+	/* Folds a with op, starting from init, which must not change the result:
+	   0 for a sum, an element of a for min and max. The additions are not
+	   done in the order of a loop's. */
+	template <typename Op>
+	double f64_reduce(const double* a, size_t n, double init) {
+		f64x acc = f64x_set1(init);
+		size_t i = 0;
+		for (; i + f64x_width <= n; i += f64x_width) acc = Op::vec(acc, f64x_load(a + i));
+		double lanes[f64x_width];
+		f64x_store(lanes, acc);
+		double r = init;
+		for (double x : lanes) r = Op::one(r, x);
+		for (; i < n; i++) r = Op::one(r, a[i]);
+		return r;
+	}
+
+	double f64_dot(const double* a, const double* b, size_t n) {
+		f64x acc = f64x_set1(0);
+		size_t i = 0;
+		for (; i + f64x_width <= n; i += f64x_width) acc = f64x_add(acc, f64x_mul(f64x_load(a + i), f64x_load(b + i)));
+		double lanes[f64x_width];
+		f64x_store(lanes, acc);
+		double r = 0;
+		for (double x : lanes) r += x;
+		for (; i < n; i++) r += a[i] * b[i];
+		return r;
+	}
+
+	void f64_sqrt(double* r, const double* a, size_t n) {
+		size_t i = 0;
+		for (; i + f64x_width <= n; i += f64x_width) f64x_store(r + i, f64x_sqrt(f64x_load(a + i)));
+		for (; i < n; i++) r[i] = sqrt(a[i]);
+	}
+
+	/* Element-wise arithmetic, when an argument is an f64array. The others are
+	   numbers or f64arrays of the same length. A single argument x gives
+	   op(unit, x). */
+	template <typename Op>
+	error f64array_arith(const std::vector<atom>& vargs, double unit, atom* result) {
+		size_t n = 0;
+		bool sized = false;
+		for (auto& a : vargs) {
+			if (a.type() == T_F64ARRAY) {
+				size_t m = a.asp<std::vector<double>>().size();
+				if (sized && m != n) return ERROR_ARGS;
+				n = m;
+				sized = true;
+			}
+			else if (a.type() != T_NUM) return ERROR_TYPE;
+		}
+		std::vector<double> r(n);
+		std::vector<double> scalars(vargs.size());
+		auto operand = [&](size_t i, bool* scalar) -> const double* {
+			*scalar = vargs[i].type() == T_NUM;
+			if (!*scalar) return vargs[i].asp<std::vector<double>>().data();
+			scalars[i] = vargs[i].number();
+			return &scalars[i];
+		};
+		bool a_scalar, b_scalar;
+		const double* a = operand(0, &a_scalar);
+		if (vargs.size() == 1) {
+			f64_map<Op>(r.data(), &unit, true, a, a_scalar, n);
+		}
+		else {
+			size_t i;
+			for (i = 1; i < vargs.size(); i++) {
+				const double* b = operand(i, &b_scalar);
+				f64_map<Op>(r.data(), a, a_scalar, b, b_scalar, n);
+				a = r.data();
+				a_scalar = false;
+			}
+		}
+		*result = make_f64array(std::move(r));
+		return ERROR_OK;
+	}
+
+	error builtin_strbuf_add(const std::vector<atom>& vargs, atom* result);
+
 	/*
 + args
 Addition. This operator also performs string and list concatenation.
+On a string builder it appends the other args to it in place and returns it.
 	*/
 	error builtin_add(const std::vector<atom>& vargs, atom* result)
 	{
@@ -831,25 +1918,41 @@ Addition. This operator also performs string and list concatenation.
 			*result = make_number(0);
 		}
 		else {
-			if (vargs[0].type == T_NUM) {
-				double r = std::get<double>(vargs[0].val);
+			if (vargs[0].type() == T_NUM) {
+				/* exact while the arguments are integers and the sum fits */
+				int64_t n = 0;
 				size_t i;
-				for (i = 1; i < vargs.size(); i++) {
-					if (vargs[i].type != T_NUM) return ERROR_TYPE;
-					r += std::get<double>(vargs[i].val);
+				for (i = 0; i < vargs.size() && vargs[i].is_int(); i++) {
+					int64_t sum;
+					if (!add_int(n, vargs[i].integer(), &sum)) break;
+					n = sum;
+				}
+				if (i == vargs.size()) {
+					*result = make_int(n);
+					return ERROR_OK;
+				}
+				double r = n;
+				for (; i < vargs.size(); i++) {
+					if (vargs[i].type() != T_NUM) {
+						if (vargs[i].type() == T_F64ARRAY) return f64array_arith<f64_add>(vargs, 0, result);
+						return ERROR_TYPE;
+					}
+					r += vargs[i].number();
 				}
 				*result = make_number(r);
 			}
-			else if (vargs[0].type == T_STRING) {
+			else if (vargs[0].type() == T_F64ARRAY) {
+				return f64array_arith<f64_add>(vargs, 0, result);
+			}
+			else if (vargs[0].type() == T_STRING) {
 				std::string buf;
 				size_t i;
 				for (i = 0; i < vargs.size(); i++) {
-					std::string s = to_string(vargs[i], 0);
-					buf += s;
+					append_display(buf, vargs[i]);
 				}
-				*result = make_string(buf);
+				*result = make_string(std::move(buf));
 			}
-			else if (vargs[0].type == T_CONS || vargs[0].type == T_NIL) {
+			else if (vargs[0].type() == T_CONS || vargs[0].type() == T_NIL) {
 				atom acc = nil;
 				size_t i;
 				for (i = 0; i < vargs.size(); i++) {
@@ -857,6 +1960,11 @@ Addition. This operator also performs string and list concatenation.
 				}
 				*result = acc;
 			}
+			else if (vargs[0].type() == T_STRBUF) {
+				/* so that (= s (+ s x)) adds to the builder rather than copying it */
+				return builtin_strbuf_add(vargs, result);
+			}
+			else return ERROR_TYPE;
 		}
 		return ERROR_OK;
 	}
@@ -867,16 +1975,35 @@ Addition. This operator also performs string and list concatenation.
 			*result = make_number(0);
 			return ERROR_OK;
 		}
-		if (vargs[0].type != T_NUM) return ERROR_TYPE;
+		if (vargs[0].type() == T_F64ARRAY) return f64array_arith<f64_sub>(vargs, 0, result);
+		if (vargs[0].type() != T_NUM) return ERROR_TYPE;
 		if (vargs.size() == 1) { /* 1 argument */
-			*result = make_number(-std::get<double>(vargs[0].val));
+			if (vargs[0].is_int() && vargs[0].integer() != INT64_MIN) *result = make_int(-vargs[0].integer());
+			else *result = make_number(-vargs[0].number());
 			return ERROR_OK;
 		}
-		double r = std::get<double>(vargs[0].val);
-		size_t i;
-		for (i = 1; i < vargs.size(); i++) {
-			if (vargs[i].type != T_NUM) return ERROR_TYPE;
-			r -= std::get<double>(vargs[i].val);
+		size_t i = 1;
+		double r;
+		if (vargs[0].is_int()) { /* exact while the arguments are integers and the difference fits */
+			int64_t n = vargs[0].integer();
+			for (; i < vargs.size() && vargs[i].is_int(); i++) {
+				int64_t d;
+				if (!sub_int(n, vargs[i].integer(), &d)) break;
+				n = d;
+			}
+			if (i == vargs.size()) {
+				*result = make_int(n);
+				return ERROR_OK;
+			}
+			r = n;
+		}
+		else r = vargs[0].number();
+		for (; i < vargs.size(); i++) {
+			if (vargs[i].type() != T_NUM) {
+				if (vargs[i].type() == T_F64ARRAY) return f64array_arith<f64_sub>(vargs, 0, result);
+				return ERROR_TYPE;
+			}
+			r -= vargs[i].number();
 		}
 		*result = make_number(r);
 		return ERROR_OK;
@@ -884,11 +2011,25 @@ Addition. This operator also performs string and list concatenation.
 
 	error builtin_multiply(const std::vector<atom>& vargs, atom* result)
 	{
-		double r = 1;
+		/* exact while the arguments are integers and the product fits */
+		int64_t n = 1;
 		size_t i;
-		for (i = 0; i < vargs.size(); i++) {
-			if (vargs[i].type != T_NUM) return ERROR_TYPE;
-			r *= std::get<double>(vargs[i].val);
+		for (i = 0; i < vargs.size() && vargs[i].is_int(); i++) {
+			int64_t p;
+			if (!mul_int(n, vargs[i].integer(), &p)) break;
+			n = p;
+		}
+		if (i == vargs.size()) {
+			*result = make_int(n);
+			return ERROR_OK;
+		}
+		double r = n;
+		for (; i < vargs.size(); i++) {
+			if (vargs[i].type() != T_NUM) {
+				if (vargs[i].type() == T_F64ARRAY) return f64array_arith<f64_mul>(vargs, 1, result);
+				return ERROR_TYPE;
+			}
+			r *= vargs[i].number();
 		}
 		*result = make_number(r);
 		return ERROR_OK;
@@ -900,16 +2041,20 @@ Addition. This operator also performs string and list concatenation.
 			*result = make_number(1);
 			return ERROR_OK;
 		}
-		if (vargs[0].type != T_NUM) return ERROR_TYPE;
+		if (vargs[0].type() == T_F64ARRAY) return f64array_arith<f64_div>(vargs, 1, result);
+		if (vargs[0].type() != T_NUM) return ERROR_TYPE;
 		if (vargs.size() == 1) { /* 1 argument */
-			*result = make_number(1.0 / std::get<double>(vargs[0].val));
+			*result = make_number(1.0 / vargs[0].number());
 			return ERROR_OK;
 		}
-		double r = std::get<double>(vargs[0].val);
+		double r = vargs[0].number();
 		size_t i;
 		for (i = 1; i < vargs.size(); i++) {
-			if (vargs[i].type != T_NUM) return ERROR_TYPE;
-			r /= std::get<double>(vargs[i].val);
+			if (vargs[i].type() != T_NUM) {
+				if (vargs[i].type() == T_F64ARRAY) return f64array_arith<f64_div>(vargs, 1, result);
+				return ERROR_TYPE;
+			}
+			r /= vargs[i].number();
 		}
 		*result = make_number(r);
 		return ERROR_OK;
@@ -922,10 +2067,13 @@ Addition. This operator also performs string and list concatenation.
 			return ERROR_OK;
 		}
 		size_t i;
-		switch (vargs[0].type) {
+		for (i = 1; i < vargs.size(); i++) {
+			if (vargs[i].type() != vargs[0].type()) return ERROR_TYPE;
+		}
+		switch (vargs[0].type()) {
 		case T_NUM:
 			for (i = 0; i < vargs.size() - 1; i++) {
-				if (std::get<double>(vargs[i].val) >= std::get<double>(vargs[i + 1].val)) {
+				if (num_compare(vargs[i], vargs[i + 1]) != -1) {
 					*result = nil;
 					return ERROR_OK;
 				}
@@ -941,6 +2089,15 @@ Addition. This operator also performs string and list concatenation.
 			}
 			*result = sym_t;
 			return ERROR_OK;
+		case T_CHAR: /* by code point */
+			for (i = 0; i < vargs.size() - 1; i++) {
+				if (vargs[i].character() >= vargs[i + 1].character()) {
+					*result = nil;
+					return ERROR_OK;
+				}
+			}
+			*result = sym_t;
+			return ERROR_OK;
 		default:
 			return ERROR_TYPE;
 		}
@@ -953,10 +2110,13 @@ Addition. This operator also performs string and list concatenation.
 			return ERROR_OK;
 		}
 		size_t i;
-		switch (vargs[0].type) {
+		for (i = 1; i < vargs.size(); i++) {
+			if (vargs[i].type() != vargs[0].type()) return ERROR_TYPE;
+		}
+		switch (vargs[0].type()) {
 		case T_NUM:
 			for (i = 0; i < vargs.size() - 1; i++) {
-				if (std::get<double>(vargs[i].val) <= std::get<double>(vargs[i + 1].val)) {
+				if (num_compare(vargs[i], vargs[i + 1]) != 1) {
 					*result = nil;
 					return ERROR_OK;
 				}
@@ -972,6 +2132,15 @@ Addition. This operator also performs string and list concatenation.
 			}
 			*result = sym_t;
 			return ERROR_OK;
+		case T_CHAR: /* by code point */
+			for (i = 0; i < vargs.size() - 1; i++) {
+				if (vargs[i].character() <= vargs[i + 1].character()) {
+					*result = nil;
+					return ERROR_OK;
+				}
+			}
+			*result = sym_t;
+			return ERROR_OK;
 		default:
 			return ERROR_TYPE;
 		}
@@ -990,43 +2159,55 @@ Addition. This operator also performs string and list concatenation.
 	}
 
 	bool is(const atom& a, const atom& b) {
-		if (a.type == b.type) {
-			switch (a.type) {
+		if (a.type() == b.type()) {
+			switch (a.type()) {
 			case T_NIL:
 				return true;
 			case T_CONS:
-				return std::get<std::shared_ptr<struct cons>>(a.val) == std::get<std::shared_ptr<struct cons>>(b.val); // compare pointers
+				return a.bits == b.bits; // compare pointers
 			case T_CLOSURE:
 			case T_MACRO:
-				return std::get<std::shared_ptr<struct closure>>(a.val) == std::get<std::shared_ptr<struct closure>>(b.val); // compare pointers
+				return a.bits == b.bits; // compare pointers
 			case T_BUILTIN:
-				return std::get<builtin>(a.val) == std::get<builtin>(b.val);
+				return a.fn() == b.fn();
 			case T_SYM:
-				return std::get<sym>(a.val) == std::get<sym>(b.val);
+				return a.symbol() == b.symbol();
 			case T_NUM:
-				return std::get<double>(a.val) == std::get<double>(b.val);
+				return num_compare(a, b) == 0;
 			case T_STRING:
 				return a.asp<std::string>() == b.asp<std::string>();
 			case T_CHAR:
-				return std::get<char>(a.val) == std::get<char>(b.val);
+				return a.character() == b.character();
 			case T_TABLE:
-				return std::get<std::shared_ptr<table>>(a.val) == std::get<std::shared_ptr<table>>(b.val); // compare pointers
+			case T_VECTOR:
+			case T_F64ARRAY:
+			case T_SORTED_TABLE:
+			case T_IMAP:
+			case T_STRBUF:
+				return a.bits == b.bits; // compare pointers
 			case T_INPUT:
 			case T_INPUT_PIPE:
 			case T_OUTPUT:
-				return std::get<FILE*>(a.val) == std::get<FILE*>(b.val);
+				return a.file() == b.file();
 			case T_CONTINUATION:
-				return std::get<jmp_buf*>(a.val) == std::get<jmp_buf*>(b.val);
+				return a.continuation() == b.continuation();
 			}
 		}
 		return false;
 	}
 
 	bool iso(const atom& a, const atom& b) {
-		if (a.type == b.type) {
-			switch (a.type) {
+		if (a.type() == b.type()) {
+			switch (a.type()) {
 			case T_CONS:
 				return iso(car(a), car(b)) && iso(cdr(a), cdr(b));
+			case T_VECTOR: {
+				auto& va = a.asp<std::vector<atom>>();
+				auto& vb = b.asp<std::vector<atom>>();
+				return va.size() == vb.size() && std::equal(va.begin(), va.end(), vb.begin(), iso);
+			}
+			case T_F64ARRAY:
+				return a.asp<std::vector<double>>() == b.asp<std::vector<double>>();
 			default:
 				return is(a, b);
 			}
@@ -1057,7 +2238,7 @@ Addition. This operator also performs string and list concatenation.
 	error builtin_scar(const std::vector<atom>& vargs, atom* result) {
 		if (vargs.size() != 2) return ERROR_ARGS;
 		atom place = vargs[0], value;
-		if (place.type != T_CONS) return ERROR_TYPE;
+		if (place.type() != T_CONS) return ERROR_TYPE;
 		value = vargs[1];
 		car(place) = value;
 		*result = value;
@@ -1067,7 +2248,7 @@ Addition. This operator also performs string and list concatenation.
 	error builtin_scdr(const std::vector<atom>& vargs, atom* result) {
 		if (vargs.size() != 2) return ERROR_ARGS;
 		atom place = vargs[0], value;
-		if (place.type != T_CONS) return ERROR_TYPE;
+		if (place.type() != T_CONS) return ERROR_TYPE;
 		value = vargs[1];
 		cdr(place) = value;
 		*result = value;
@@ -1078,8 +2259,16 @@ Addition. This operator also performs string and list concatenation.
 		if (vargs.size() != 2) return ERROR_ARGS;
 		atom dividend = vargs[0];
 		atom divisor = vargs[1];
-		double r = fmod(std::get<double>(dividend.val), std::get<double>(divisor.val));
-		if (std::get<double>(dividend.val) * std::get<double>(divisor.val) < 0 && r != 0) r += std::get<double>(divisor.val);
+		if (dividend.type() != T_NUM || divisor.type() != T_NUM) return ERROR_TYPE;
+		if (dividend.is_int() && divisor.is_int() && divisor.integer() != 0) {
+			int64_t a = dividend.integer(), b = divisor.integer();
+			int64_t m = b == -1 ? 0 : a % b;
+			if (m != 0 && (m < 0) != (b < 0)) m += b;
+			*result = make_int(m);
+			return ERROR_OK;
+		}
+		double r = fmod(dividend.number(), divisor.number());
+		if (dividend.number() * divisor.number() < 0 && r != 0) r += divisor.number();
 		*result = make_number(r);
 		return ERROR_OK;
 	}
@@ -1087,7 +2276,7 @@ Addition. This operator also performs string and list concatenation.
 	error builtin_type(const std::vector<atom>& vargs, atom* result) {
 		if (vargs.size() != 1) return ERROR_ARGS;
 		atom x = vargs[0];
-		switch (x.type) {
+		switch (x.type()) {
 		case T_CONS: *result = sym_cons; break;
 		case T_SYM:
 		case T_NIL: *result = sym_sym; break;
@@ -1099,6 +2288,11 @@ Addition. This operator also performs string and list concatenation.
 		case T_NUM: *result = sym_num; break;
 		case T_MACRO: *result = sym_mac; break;
 		case T_TABLE: *result = sym_table; break;
+		case T_VECTOR: *result = sym_vector; break;
+		case T_F64ARRAY: *result = sym_f64array; break;
+		case T_SORTED_TABLE: *result = sym_sorted_table; break;
+		case T_IMAP: *result = sym_imap; break;
+		case T_STRBUF: *result = sym_strbuf; break;
 		case T_CHAR: *result = sym_char; break;
 		case T_INPUT: *result = make_sym("input"); break;
 		case T_INPUT_PIPE: *result = make_sym("input-pipe"); break;
@@ -1108,16 +2302,54 @@ Addition. This operator also performs string and list concatenation.
 		return ERROR_OK;
 	}
 
-	/* string-sref obj value index */
+	/* string-sref obj value index
+	   Replaces the code point at index, whose UTF-8 may be longer or shorter. */
 	error builtin_string_sref(const std::vector<atom>& vargs, atom* result) {
 		atom index, obj, value;
 		if (vargs.size() != 3) return ERROR_ARGS;
 		obj = vargs[0];
-		if (obj.type != T_STRING) return ERROR_TYPE;
 		value = vargs[1];
 		index = vargs[2];
-		obj.asp<std::string>()[(long)std::get<double>(index.val)] = std::get<char>(value.val);
-		*result = make_char(std::get<char>(value.val));
+		if (obj.type() != T_STRING || value.type() != T_CHAR || index.type() != T_NUM) return ERROR_TYPE;
+		auto o = (struct string_object*)obj.obj();
+		double i = index.number();
+		if (!(i >= 0 && i < o->length())) return ERROR_RANGE;
+		std::string& v = o->value;
+		size_t at = o->offset((size_t)i), next;
+		utf8_decode([&v](size_t j) { return v[j]; }, at, v.size(), &next);
+		std::string c;
+		utf8_append(c, value.character());
+		v.replace(at, next - at, c);
+		if (c.size() != next - at) o->changed(); /* the offsets after it moved */
+		*result = value;
+		return ERROR_OK;
+	}
+
+	/* vector-sref obj value index */
+	error builtin_vector_sref(const std::vector<atom>& vargs, atom* result) {
+		if (vargs.size() != 3) return ERROR_ARGS;
+		const atom& obj = vargs[0];
+		const atom& index = vargs[2];
+		if (obj.type() != T_VECTOR || index.type() != T_NUM) return ERROR_TYPE;
+		auto& v = obj.asp<std::vector<atom>>();
+		double i = index.number();
+		if (!(i >= 0 && i < v.size())) return ERROR_RANGE;
+		v[(size_t)i] = vargs[1];
+		*result = vargs[1];
+		return ERROR_OK;
+	}
+
+	/* f64array-sref obj value index */
+	error builtin_f64array_sref(const std::vector<atom>& vargs, atom* result) {
+		if (vargs.size() != 3) return ERROR_ARGS;
+		const atom& obj = vargs[0];
+		const atom& index = vargs[2];
+		if (obj.type() != T_F64ARRAY || vargs[1].type() != T_NUM || index.type() != T_NUM) return ERROR_TYPE;
+		auto& v = obj.asp<std::vector<double>>();
+		double i = index.number();
+		if (!(i >= 0 && i < v.size())) return ERROR_RANGE;
+		v[(size_t)i] = vargs[1].number();
+		*result = vargs[1];
 		return ERROR_OK;
 	}
 
@@ -1133,12 +2365,13 @@ Addition. This operator also performs string and list concatenation.
 			fp = stdout;
 			break;
 		case 2:
-			fp = std::get<FILE*>(vargs[1].val);
+			if (vargs[1].type() != T_OUTPUT) return ERROR_TYPE;
+			fp = vargs[1].file();
 			break;
 		default:
 			return ERROR_ARGS;
 		}
-		fprintf(fp, "%s", to_string(vargs[0], 0).c_str());
+		print_atom(fp, vargs[0], 0);
 		*result = nil;
 		return ERROR_OK;
 	}
@@ -1152,11 +2385,13 @@ Addition. This operator also performs string and list concatenation.
 			fp = stdout;
 			break;
 		case 2:
-			fp = std::get<FILE*>(vargs[1].val);
+			if (vargs[1].type() != T_OUTPUT) return ERROR_TYPE;
+			fp = vargs[1].file();
 			break;
 		default: return ERROR_ARGS;
 		}
-		fputc((int)std::get<double>(vargs[0].val), fp);
+		if (vargs[0].type() != T_NUM) return ERROR_TYPE;
+		fputc((int)vargs[0].number(), fp);
 		*result = nil;
 		return ERROR_OK;
 	}
@@ -1166,7 +2401,8 @@ Addition. This operator also performs string and list concatenation.
 		if (vargs.size() != 2) return ERROR_ARGS;
 		a = vargs[0];
 		b = vargs[1];
-		*result = make_number(pow(std::get<double>(a.val), std::get<double>(b.val)));
+		if (a.type() != T_NUM || b.type() != T_NUM) return ERROR_TYPE;
+		*result = make_number(pow(a.number(), b.number()));
 		return ERROR_OK;
 	}
 
@@ -1174,7 +2410,15 @@ Addition. This operator also performs string and list concatenation.
 		atom a;
 		if (vargs.size() != 1) return ERROR_ARGS;
 		a = vargs[0];
-		*result = make_number(log(std::get<double>(a.val)));
+		if (a.type() == T_F64ARRAY) { /* no vector instruction for log */
+			auto& v = a.asp<std::vector<double>>();
+			std::vector<double> r(v.size());
+			std::transform(v.begin(), v.end(), r.begin(), [](double x) { return log(x); });
+			*result = make_f64array(std::move(r));
+			return ERROR_OK;
+		}
+		if (a.type() != T_NUM) return ERROR_TYPE;
+		*result = make_number(log(a.number()));
 		return ERROR_OK;
 	}
 
@@ -1182,7 +2426,15 @@ Addition. This operator also performs string and list concatenation.
 		atom a;
 		if (vargs.size() != 1) return ERROR_ARGS;
 		a = vargs[0];
-		*result = make_number(sqrt(std::get<double>(a.val)));
+		if (a.type() == T_F64ARRAY) {
+			auto& v = a.asp<std::vector<double>>();
+			std::vector<double> r(v.size());
+			f64_sqrt(r.data(), v.data(), v.size());
+			*result = make_f64array(std::move(r));
+			return ERROR_OK;
+		}
+		if (a.type() != T_NUM) return ERROR_TYPE;
+		*result = make_number(sqrt(a.number()));
 		return ERROR_OK;
 	}
 
@@ -1193,8 +2445,8 @@ Addition. This operator also performs string and list concatenation.
 			str = readline("");
 		}
 		else if (l == 1) {
-			if (vargs[0].type != T_INPUT && vargs[0].type != T_INPUT_PIPE) return ERROR_TYPE;
-			str = readline_fp("", std::get<FILE*>(vargs[0].val));
+			if (vargs[0].type() != T_INPUT && vargs[0].type() != T_INPUT_PIPE) return ERROR_TYPE;
+			str = readline_fp("", vargs[0].file());
 		}
 		else {
 			return ERROR_ARGS;
@@ -1203,7 +2455,7 @@ Addition. This operator also performs string and list concatenation.
 		return ERROR_OK;
 	}
 
-	error builtin_quit(const std::vector<atom>& vargs, atom* result) {
+	error builtin_quit(const std::vector<atom>& vargs, atom* /* result */) {
 		if (vargs.size() != 0) return ERROR_ARGS;
 		exit(0);
 	}
@@ -1215,7 +2467,10 @@ Addition. This operator also performs string and list concatenation.
 	error builtin_rand(const std::vector<atom>& vargs, atom* result) {
 		long alen = vargs.size();
 		if (alen == 0) *result = make_number(rand_double());
-		else if (alen == 1) *result = make_number(floor(rand_double() * std::get<double>(vargs[0].val)));
+		else if (alen == 1) {
+			if (vargs[0].type() != T_NUM) return ERROR_TYPE;
+			*result = make_number(floor(rand_double() * vargs[0].number()));
+		}
 		else return ERROR_ARGS;
 		return ERROR_OK;
 	}
@@ -1250,13 +2505,13 @@ Addition. This operator also performs string and list concatenation.
 		}
 		else if (alen <= 2) {
 			atom src = vargs[0];
-			if (src.type == T_STRING) {
+			if (src.type() == T_STRING) {
 				const char* s = src.asp<std::string>().c_str();
 				const char* buf = s;
 				err = read_expr(buf, &buf, result);
 			}
-			else if (src.type == T_INPUT || src.type == T_INPUT_PIPE) {
-				err = read_fp(std::get<FILE*>(src.val), result);
+			else if (src.type() == T_INPUT || src.type() == T_INPUT_PIPE) {
+				err = read_fp(src.file(), result);
 			}
 			else {
 				return ERROR_TYPE;
@@ -1294,9 +2549,58 @@ Addition. This operator also performs string and list concatenation.
 		std::string s;
 		size_t i;
 		for (i = 0; i < vargs.size(); i++) {
-			s += to_string(vargs[i], 0);
+			append_display(s, vargs[i]);
+		}
+		*result = make_string(std::move(s));
+		return ERROR_OK;
+	}
+
+	/* strbuf [arg ...]
+	   Returns a string builder holding the args as disp prints them. */
+	error builtin_strbuf(const std::vector<atom>& vargs, atom* result) {
+		*result = make_strbuf();
+		auto& r = result->asp<rope>();
+		std::string s;
+		for (auto& a : vargs) {
+			if (a.type() == T_STRING) r.append(a.asp<std::string>());
+			else {
+				s.clear();
+				append_display(s, a);
+				r.append(s);
+			}
+		}
+		return ERROR_OK;
+	}
+
+	/* strbuf-add obj [arg ...]
+	   Appends the args to string builder obj as disp prints them, and returns obj. */
+	error builtin_strbuf_add(const std::vector<atom>& vargs, atom* result) {
+		if (vargs.size() < 1) return ERROR_ARGS;
+		if (vargs[0].type() != T_STRBUF) return ERROR_TYPE;
+		auto& r = vargs[0].asp<rope>();
+		std::string s;
+		for (size_t i = 1; i < vargs.size(); i++) {
+			const atom& a = vargs[i];
+			if (a.type() == T_STRING) r.append(a.asp<std::string>());
+			else if (a.type() == T_STRBUF && a.bits != vargs[0].bits) {
+				a.asp<rope>().each_chunk([&](std::string_view c) { r.append(c); });
+			}
+			else {
+				s.clear();
+				append_display(s, a);
+				r.append(s);
+			}
 		}
-		*result = make_string(s);
+		*result = vargs[0];
+		return ERROR_OK;
+	}
+
+	/* uniq
+	 * Returns a new symbol. Its name, _uniq followed by a number, is made when it is first printed.
+	 */
+	error builtin_uniq(const std::vector<atom>& vargs, atom* result) {
+		if (vargs.size() != 0) return ERROR_ARGS;
+		*result = make_uniq();
 		return ERROR_OK;
 	}
 
@@ -1313,7 +2617,7 @@ Addition. This operator also performs string and list concatenation.
 		long alen = vargs.size();
 		if (alen == 1) {
 			atom a = vargs[0];
-			if (a.type != T_STRING) return ERROR_TYPE;
+			if (a.type() != T_STRING) return ERROR_TYPE;
 			*result = make_number(system(vargs[0].asp<std::string>().c_str()));
 			return ERROR_OK;
 		}
@@ -1328,7 +2632,7 @@ Addition. This operator also performs string and list concatenation.
 	error builtin_load(const std::vector<atom>& vargs, atom* result) {
 		if (vargs.size() == 1) {
 			atom a = vargs[0];
-			if (a.type != T_STRING) return ERROR_TYPE;
+			if (a.type() != T_STRING) return ERROR_TYPE;
 			*result = nil;
 			return arc_load_file(a.asp<std::string>().c_str());
 		}
@@ -1338,18 +2642,18 @@ Addition. This operator also performs string and list concatenation.
 	error builtin_int(const std::vector<atom>& vargs, atom* result) {
 		if (vargs.size() == 1) {
 			atom a = vargs[0];
-			switch (a.type) {
+			switch (a.type()) {
 			case T_STRING:
-				*result = make_number(atol(a.asp<std::string>().c_str()));
+				*result = parse_int(a.asp<std::string>().c_str());
 				break;
 			case T_SYM:
-				*result = make_number(atol(to_string(a, 0).c_str()));
+				*result = parse_int(to_string(a, 0).c_str());
 				break;
 			case T_NUM:
-				*result = make_number((long)(std::get<double>(a.val)));
+				*result = a.is_int() ? a : make_integral(trunc(a.number()));
 				break;
 			case T_CHAR:
-				*result = make_number(std::get<char>(a.val));
+				*result = make_number(a.character());
 				break;
 			default:
 				return ERROR_TYPE;
@@ -1362,8 +2666,8 @@ Addition. This operator also performs string and list concatenation.
 	error builtin_trunc(const std::vector<atom>& vargs, atom* result) {
 		if (vargs.size() == 1) {
 			atom a = vargs[0];
-			if (a.type != T_NUM) return ERROR_TYPE;
-			*result = make_number(trunc(std::get<double>(a.val)));
+			if (a.type() != T_NUM) return ERROR_TYPE;
+			*result = a.is_int() ? a : make_integral(trunc(a.number()));
 			return ERROR_OK;
 		}
 		else return ERROR_ARGS;
@@ -1372,8 +2676,8 @@ Addition. This operator also performs string and list concatenation.
 	error builtin_sin(const std::vector<atom>& vargs, atom* result) {
 		if (vargs.size() == 1) {
 			atom a = vargs[0];
-			if (a.type != T_NUM) return ERROR_TYPE;
-			*result = make_number(sin(std::get<double>(a.val)));
+			if (a.type() != T_NUM) return ERROR_TYPE;
+			*result = make_number(sin(a.number()));
 			return ERROR_OK;
 		}
 		else return ERROR_ARGS;
@@ -1382,8 +2686,8 @@ Addition. This operator also performs string and list concatenation.
 	error builtin_cos(const std::vector<atom>& vargs, atom* result) {
 		if (vargs.size() == 1) {
 			atom a = vargs[0];
-			if (a.type != T_NUM) return ERROR_TYPE;
-			*result = make_number(cos(std::get<double>(a.val)));
+			if (a.type() != T_NUM) return ERROR_TYPE;
+			*result = make_number(cos(a.number()));
 			return ERROR_OK;
 		}
 		else return ERROR_ARGS;
@@ -1392,8 +2696,8 @@ Addition. This operator also performs string and list concatenation.
 	error builtin_tan(const std::vector<atom>& vargs, atom* result) {
 		if (vargs.size() == 1) {
 			atom a = vargs[0];
-			if (a.type != T_NUM) return ERROR_TYPE;
-			*result = make_number(tan(std::get<double>(a.val)));
+			if (a.type() != T_NUM) return ERROR_TYPE;
+			*result = make_number(tan(a.number()));
 			return ERROR_OK;
 		}
 		else return ERROR_ARGS;
@@ -1402,9 +2706,13 @@ Addition. This operator also performs string and list concatenation.
 	error builtin_bound(const std::vector<atom>& vargs, atom* result) {
 		if (vargs.size() == 1) {
 			atom a = vargs[0];
-			if (a.type != T_SYM) return ERROR_TYPE;
-			error err = env_get(global_env, std::get<sym>(a.val), result);
-			*result = (err ? nil : sym_t);
+			if (a.type() != T_SYM) return ERROR_TYPE;
+			struct cell* c = global_cell(a.symbol());
+			if (!c->bound && c->unit) {
+				error err = image_load_unit(c->unit - 1);
+				if (err) return err;
+			}
+			*result = c->bound ? sym_t : nil;
 			return ERROR_OK;
 		}
 		else return ERROR_ARGS;
@@ -1413,7 +2721,7 @@ Addition. This operator also performs string and list concatenation.
 	error builtin_infile(const std::vector<atom>& vargs, atom* result) {
 		const char* mode = "rb";
 		if (vargs.size() == 2) {
-			if (vargs[1].type != T_SYM) return ERROR_TYPE;
+			if (vargs[1].type() != T_SYM) return ERROR_TYPE;
 			if (to_string(vargs[1], 0) == "text") {
 				mode = "r";
 			}
@@ -1422,7 +2730,7 @@ Addition. This operator also performs string and list concatenation.
 		}
 		else return ERROR_ARGS;
 		atom a = vargs[0];
-		if (a.type != T_STRING) return ERROR_TYPE;
+		if (a.type() != T_STRING) return ERROR_TYPE;
 		FILE* fp = fopen(a.asp<std::string>().c_str(), mode);
 		if (!fp) return ERROR_FILE;
 		*result = make_input(fp);
@@ -1440,8 +2748,9 @@ Addition. This operator also performs string and list concatenation.
 		}
 		else return ERROR_ARGS;
 		atom a = vargs[0];
-		if (a.type != T_STRING) return ERROR_TYPE;
+		if (a.type() != T_STRING) return ERROR_TYPE;
 		FILE* fp = fopen(a.asp<std::string>().c_str(), mode);
+		if (!fp) return ERROR_FILE;
 		*result = make_output(fp);
 		return ERROR_OK;
 	}
@@ -1450,11 +2759,11 @@ Addition. This operator also performs string and list concatenation.
 	error builtin_close(const std::vector<atom>& vargs, atom* result) {
 		if (vargs.size() >= 1) {
 			for (atom a : vargs) {
-				if (a.type != T_INPUT && a.type != T_INPUT_PIPE && a.type != T_OUTPUT) return ERROR_TYPE;
-				if (a.type == T_INPUT_PIPE)
-					pclose(std::get<FILE*>(a.val));
+				if (a.type() != T_INPUT && a.type() != T_INPUT_PIPE && a.type() != T_OUTPUT) return ERROR_TYPE;
+				if (a.type() == T_INPUT_PIPE)
+					pclose(a.file());
 				else
-					fclose(std::get<FILE*>(a.val));
+					fclose(a.file());
 			}
 			*result = nil;
 			return ERROR_OK;
@@ -1470,7 +2779,8 @@ Addition. This operator also performs string and list concatenation.
 			fp = stdin;
 			break;
 		case 1:
-			fp = std::get<FILE*>(vargs[0].val);
+			if (vargs[0].type() != T_INPUT && vargs[0].type() != T_INPUT_PIPE) return ERROR_TYPE;
+			fp = vargs[0].file();
 			break;
 		default:
 			return ERROR_ARGS;
@@ -1482,7 +2792,8 @@ Addition. This operator also performs string and list concatenation.
 	/* sread input-port eof */
 	error builtin_sread(const std::vector<atom>& vargs, atom* result) {
 		if (vargs.size() != 2) return ERROR_ARGS;
-		FILE* fp = std::get<FILE*>(vargs[0].val);
+		if (vargs[0].type() != T_INPUT && vargs[0].type() != T_INPUT_PIPE) return ERROR_TYPE;
+		FILE* fp = vargs[0].file();
 		atom eof = vargs[1];
 		error err;
 		if (feof(fp)) {
@@ -1490,8 +2801,10 @@ Addition. This operator also performs string and list concatenation.
 			return ERROR_OK;
 		}
 		char* s = slurp_fp(fp);
+		if (!s) return ERROR_FILE;
 		const char* p = s;
 		err = read_expr(p, &p, result);
+		free(s);
 		return err;
 	}
 
@@ -1507,14 +2820,13 @@ Addition. This operator also performs string and list concatenation.
 			fp = stdout;
 			break;
 		case 2:
-			fp = std::get<FILE*>(vargs[1].val);
+			if (vargs[1].type() != T_OUTPUT) return ERROR_TYPE;
+			fp = vargs[1].file();
 			break;
 		default:
 			return ERROR_ARGS;
 		}
-		atom a = vargs[0];
-		std::string s = to_string(a, 1);
-		fprintf(fp, "%s", s.c_str());
+		print_atom(fp, vargs[0], 1);
 		*result = nil;
 		return ERROR_OK;
 	}
@@ -1522,122 +2834,399 @@ Addition. This operator also performs string and list concatenation.
 	/* newstring length [char] */
 	error builtin_newstring(const std::vector<atom>& vargs, atom* result) {
 		long arg_len = vargs.size();
-		long length = (long)std::get<double>(vargs[0].val);
-		char c = 0;
-		char* s;
-		switch (arg_len) {
-		case 1: break;
-		case 2:
-			c = std::get<char>(vargs[1].val);
-			break;
-		default:
-			return ERROR_ARGS;
+		if (arg_len != 1 && arg_len != 2) return ERROR_ARGS;
+		if (vargs[0].type() != T_NUM) return ERROR_TYPE;
+		long length = (long)vargs[0].number();
+		uint32_t c = 0;
+		if (arg_len == 2) {
+			if (vargs[1].type() != T_CHAR) return ERROR_TYPE;
+			c = vargs[1].character();
 		}
-		s = (char*)malloc((length + 1) * sizeof(char));
-		int i;
-		for (i = 0; i < length; i++)
-			s[i] = c;
-		s[length] = 0; /* end of string */
-		*result = make_string(s);
+		std::string one, s;
+		utf8_append(one, c);
+		s.reserve(one.size() * std::max(length, 0L));
+		for (long i = 0; i < length; i++) s += one;
+		*result = make_string(std::move(s));
 		return ERROR_OK;
 	}
 
-	error builtin_table(const std::vector<atom>& vargs, atom* result) {
-		long arg_len = vargs.size();
-		if (arg_len != 0) return ERROR_ARGS;
-		*result = make_table();
+	/* vector [arg ...] */
+	error builtin_vector(const std::vector<atom>& vargs, atom* result) {
+		*result = make_vector(vargs);
 		return ERROR_OK;
 	}
 
-	/* maptable proc table */
-	error builtin_maptable(const std::vector<atom>& vargs, atom* result) {
+	/* newvector length [value] */
+	error builtin_newvector(const std::vector<atom>& vargs, atom* result) {
 		long arg_len = vargs.size();
-		if (arg_len != 2) return ERROR_ARGS;
-		const atom& proc = vargs[0];
-		const atom& tbl = vargs[1];
-		if (tbl.type != T_TABLE) return ERROR_TYPE;
-		auto& table1 = tbl.asp<table>();
-		std::vector<atom> v;
-		for (auto& p : table1) {
-			v.clear();
-			v.push_back(p.first);
-			v.push_back(p.second);
-			error err = apply(proc, v, result);
-			if (err) return err;
-		}
-		*result = tbl;
+		if (arg_len != 1 && arg_len != 2) return ERROR_ARGS;
+		if (vargs[0].type() != T_NUM || vargs[0].number() < 0) return ERROR_TYPE;
+		*result = make_vector(std::vector<atom>((size_t)vargs[0].number(), arg_len == 2 ? vargs[1] : nil));
 		return ERROR_OK;
 	}
 
-	/* table-sref obj value index */
-	error builtin_table_sref(const std::vector<atom>& vargs, atom* result) {
-		atom index, obj, value;
+	/* sorted-table */
+	error builtin_sorted_table(const std::vector<atom>& vargs, atom* result) {
+		if (vargs.size() != 0) return ERROR_ARGS;
+		*result = make_sorted_table();
+		return ERROR_OK;
+	}
+
+	/* sorted-table-sref obj value key */
+	error builtin_sorted_table_sref(const std::vector<atom>& vargs, atom* result) {
 		if (vargs.size() != 3) return ERROR_ARGS;
-		obj = vargs[0];
-		if (obj.type != T_TABLE) return ERROR_TYPE;
-		value = vargs[1];
-		index = vargs[2];
-		obj.asp<table>()[index] = value;
-		*result = value;
+		if (vargs[0].type() != T_SORTED_TABLE || !sorted_key(vargs[2])) return ERROR_TYPE;
+		if (no(vargs[1])) vargs[0].asp<sorted_table>().erase(vargs[2]); /* as in Arc, nil removes the key */
+		else vargs[0].asp<sorted_table>()[vargs[2]] = vargs[1];
+		*result = vargs[1];
 		return ERROR_OK;
 	}
 
-	/* coerce obj type */
-	/*
-Coerces object to a new type.
-A char can be coerced to int, num, string, or sym.
-A number can be coerced to int, char, or string.
-A string can be coerced to sym, cons (char list), num, or int.
-A list of characters can be coerced to a string.
-A symbol can be coerced to a string.
-	*/
-	error builtin_coerce(const std::vector<atom>& vargs, atom* result) {
-		atom obj, type;
+	/* (key . value) of e, or nil */
+	atom sorted_entry_pair(sorted_table::entry e) {
+		return e ? make_cons(e.key(), e.value()) : nil;
+	}
+
+	/* sorted-table-first obj
+	   Returns the (key . value) of the least key, or nil if obj is empty. */
+	error builtin_sorted_table_first(const std::vector<atom>& vargs, atom* result) {
+		if (vargs.size() != 1) return ERROR_ARGS;
+		if (vargs[0].type() != T_SORTED_TABLE) return ERROR_TYPE;
+		*result = sorted_entry_pair(vargs[0].asp<sorted_table>().first());
+		return ERROR_OK;
+	}
+
+	/* sorted-table-last obj */
+	error builtin_sorted_table_last(const std::vector<atom>& vargs, atom* result) {
+		if (vargs.size() != 1) return ERROR_ARGS;
+		if (vargs[0].type() != T_SORTED_TABLE) return ERROR_TYPE;
+		*result = sorted_entry_pair(vargs[0].asp<sorted_table>().last());
+		return ERROR_OK;
+	}
+
+	/* sorted-table-floor obj key
+	   Returns the (key . value) of the greatest key not above key, or nil. */
+	error builtin_sorted_table_floor(const std::vector<atom>& vargs, atom* result) {
 		if (vargs.size() != 2) return ERROR_ARGS;
-		obj = vargs[0];
-		type = vargs[1];
-		switch (obj.type) {
-		case T_CHAR:
-			if (is(type, sym_int) || is(type, sym_num)) *result = make_number(std::get<char>(obj.val));
-			else if (is(type, sym_string)) {
-				char buf[2];
-				buf[0] = std::get<char>(obj.val);
-				buf[1] = '\0';
-				*result = make_string(buf);
-			}
-			else if (is(type, sym_sym)) {
-				char buf[2];
-				buf[0] = std::get<char>(obj.val);
-				buf[1] = '\0';
-				*result = make_sym(buf);
-			}
-			else if (is(type, sym_char))
-				*result = obj;
-			else
-				return ERROR_TYPE;
-			break;
-		case T_NUM:
-			if (is(type, sym_int)) *result = make_number(floor(std::get<double>(obj.val)));
-			else if (is(type, sym_char)) *result = make_char((char)std::get<double>(obj.val));
-			else if (is(type, sym_string)) {
-				*result = make_string(to_string(obj, 0));
-			}
-			else if (is(type, sym_num))
-				*result = obj;
-			else
-				return ERROR_TYPE;
+		if (vargs[0].type() != T_SORTED_TABLE || !sorted_key(vargs[1])) return ERROR_TYPE;
+		*result = sorted_entry_pair(vargs[0].asp<sorted_table>().floor(vargs[1]));
+		return ERROR_OK;
+	}
+
+	/* sorted-table-ceiling obj key
+	   Returns the (key . value) of the least key not below key, or nil. */
+	error builtin_sorted_table_ceiling(const std::vector<atom>& vargs, atom* result) {
+		if (vargs.size() != 2) return ERROR_ARGS;
+		if (vargs[0].type() != T_SORTED_TABLE || !sorted_key(vargs[1])) return ERROR_TYPE;
+		*result = sorted_entry_pair(vargs[0].asp<sorted_table>().ceiling(vargs[1]));
+		return ERROR_OK;
+	}
+
+	/* sorted-table-range obj [from [below]]
+	   Returns the (key . value) pairs whose keys are from from and below below, in
+	   order. A missing or nil bound leaves that end open. */
+	error builtin_sorted_table_range(const std::vector<atom>& vargs, atom* result) {
+		size_t alen = vargs.size();
+		if (alen < 1 || alen > 3) return ERROR_ARGS;
+		if (vargs[0].type() != T_SORTED_TABLE) return ERROR_TYPE;
+		atom from = alen >= 2 ? vargs[1] : nil, below = alen == 3 ? vargs[2] : nil;
+		if ((!no(from) && !sorted_key(from)) || (!no(below) && !sorted_key(below))) return ERROR_TYPE;
+		auto& st = vargs[0].asp<sorted_table>();
+		atom r = nil, p;
+		for (auto e = no(from) ? st.first() : st.ceiling(from); e; e = e.next()) {
+			if (!no(below) && !sorted_less(e.key(), below)) break;
+			atom c = make_cons(sorted_entry_pair(e), nil);
+			if (no(r)) r = c;
+			else cdr(p) = c;
+			p = c;
+		}
+		*result = r;
+		return ERROR_OK;
+	}
+
+	/* imap [key value ...]
+	   Returns an immutable map of the keys to the values. */
+	error builtin_imap(const std::vector<atom>& vargs, atom* result) {
+		if (vargs.size() % 2 != 0) return ERROR_ARGS;
+		hamt h;
+		for (size_t i = 0; i < vargs.size(); i += 2) h.set(vargs[i], vargs[i + 1]);
+		*result = make_imap(h);
+		return ERROR_OK;
+	}
+
+	/* imap-assoc obj key value [key value ...]
+	   Returns obj with the keys set to the values, as a new map that shares the
+	   rest of obj; a transient obj is changed in place and returned. */
+	error builtin_imap_assoc(const std::vector<atom>& vargs, atom* result) {
+		if (vargs.size() < 3 || vargs.size() % 2 != 1) return ERROR_ARGS;
+		if (vargs[0].type() != T_IMAP) return ERROR_TYPE;
+		auto o = (struct imap_object*)vargs[0].obj();
+		hamt copy;
+		if (!o->transient) copy = o->value;
+		hamt& h = o->transient ? o->value : copy;
+		for (size_t i = 1; i < vargs.size(); i += 2) h.set(vargs[i], vargs[i + 1]);
+		*result = o->transient ? vargs[0] : make_imap(h);
+		return ERROR_OK;
+	}
+
+	/* imap-dissoc obj key [key ...]
+	   Returns obj without the keys, like imap-assoc. */
+	error builtin_imap_dissoc(const std::vector<atom>& vargs, atom* result) {
+		if (vargs.size() < 2) return ERROR_ARGS;
+		if (vargs[0].type() != T_IMAP) return ERROR_TYPE;
+		auto o = (struct imap_object*)vargs[0].obj();
+		hamt copy;
+		if (!o->transient) copy = o->value;
+		hamt& h = o->transient ? o->value : copy;
+		for (size_t i = 1; i < vargs.size(); i++) h.erase(vargs[i]);
+		*result = o->transient ? vargs[0] : make_imap(h);
+		return ERROR_OK;
+	}
+
+	/* imap-sref obj value key
+	   Sets key in a transient map, or removes it if value is nil; other imaps cannot change. */
+	error builtin_imap_sref(const std::vector<atom>& vargs, atom* result) {
+		if (vargs.size() != 3) return ERROR_ARGS;
+		if (vargs[0].type() != T_IMAP || !((struct imap_object*)vargs[0].obj())->transient) return ERROR_TYPE;
+		if (no(vargs[1])) vargs[0].asp<hamt>().erase(vargs[2]);
+		else vargs[0].asp<hamt>().set(vargs[2], vargs[1]);
+		*result = vargs[1];
+		return ERROR_OK;
+	}
+
+	/* transient obj
+	   Returns a transient copy of imap obj for a batch of changes in place. The
+	   copy shares the nodes of obj until it changes them. */
+	error builtin_transient(const std::vector<atom>& vargs, atom* result) {
+		if (vargs.size() != 1) return ERROR_ARGS;
+		if (vargs[0].type() != T_IMAP) return ERROR_TYPE;
+		*result = make_imap(vargs[0].asp<hamt>(), true);
+		return ERROR_OK;
+	}
+
+	/* persistent obj
+	   Returns an immutable copy of imap obj, in constant time. */
+	error builtin_persistent(const std::vector<atom>& vargs, atom* result) {
+		if (vargs.size() != 1) return ERROR_ARGS;
+		if (vargs[0].type() != T_IMAP) return ERROR_TYPE;
+		if (!((struct imap_object*)vargs[0].obj())->transient) *result = vargs[0];
+		else *result = make_imap(vargs[0].asp<hamt>());
+		return ERROR_OK;
+	}
+
+	/* f64array [number ...] */
+	error builtin_f64array(const std::vector<atom>& vargs, atom* result) {
+		std::vector<double> v(vargs.size());
+		size_t i;
+		for (i = 0; i < vargs.size(); i++) {
+			if (vargs[i].type() != T_NUM) return ERROR_TYPE;
+			v[i] = vargs[i].number();
+		}
+		*result = make_f64array(std::move(v));
+		return ERROR_OK;
+	}
+
+	/* newf64array length [number] */
+	error builtin_newf64array(const std::vector<atom>& vargs, atom* result) {
+		long arg_len = vargs.size();
+		if (arg_len != 1 && arg_len != 2) return ERROR_ARGS;
+		if (vargs[0].type() != T_NUM || vargs[0].number() < 0) return ERROR_TYPE;
+		if (arg_len == 2 && vargs[1].type() != T_NUM) return ERROR_TYPE;
+		*result = make_f64array(std::vector<double>((size_t)vargs[0].number(), arg_len == 2 ? vargs[1].number() : 0));
+		return ERROR_OK;
+	}
+
+	/* f64array-sum f64array */
+	error builtin_f64array_sum(const std::vector<atom>& vargs, atom* result) {
+		if (vargs.size() != 1) return ERROR_ARGS;
+		if (vargs[0].type() != T_F64ARRAY) return ERROR_TYPE;
+		auto& v = vargs[0].asp<std::vector<double>>();
+		*result = make_number(f64_reduce<f64_add>(v.data(), v.size(), 0));
+		return ERROR_OK;
+	}
+
+	/* f64array-dot f64array f64array */
+	error builtin_f64array_dot(const std::vector<atom>& vargs, atom* result) {
+		if (vargs.size() != 2) return ERROR_ARGS;
+		if (vargs[0].type() != T_F64ARRAY || vargs[1].type() != T_F64ARRAY) return ERROR_TYPE;
+		auto& a = vargs[0].asp<std::vector<double>>();
+		auto& b = vargs[1].asp<std::vector<double>>();
+		if (a.size() != b.size()) return ERROR_ARGS;
+		*result = make_number(f64_dot(a.data(), b.data(), a.size()));
+		return ERROR_OK;
+	}
+
+	/* f64array-min f64array
+	   Returns nil for an empty array. */
+	error builtin_f64array_min(const std::vector<atom>& vargs, atom* result) {
+		if (vargs.size() != 1) return ERROR_ARGS;
+		if (vargs[0].type() != T_F64ARRAY) return ERROR_TYPE;
+		auto& v = vargs[0].asp<std::vector<double>>();
+		*result = v.empty() ? nil : make_number(f64_reduce<f64_min>(v.data(), v.size(), v[0]));
+		return ERROR_OK;
+	}
+
+	/* f64array-max f64array
+	   Returns nil for an empty array. */
+	error builtin_f64array_max(const std::vector<atom>& vargs, atom* result) {
+		if (vargs.size() != 1) return ERROR_ARGS;
+		if (vargs[0].type() != T_F64ARRAY) return ERROR_TYPE;
+		auto& v = vargs[0].asp<std::vector<double>>();
+		*result = v.empty() ? nil : make_number(f64_reduce<f64_max>(v.data(), v.size(), v[0]));
+		return ERROR_OK;
+	}
+
+	/* table ['eq]
+	   With 'eq, makes a table that compares keys by identity: numbers, symbols
+	   and characters by value, and conses, strings and other objects by pointer. */
+	error builtin_table(const std::vector<atom>& vargs, atom* result) {
+		long arg_len = vargs.size();
+		if (arg_len > 1) return ERROR_ARGS;
+		bool eq = false;
+		if (arg_len == 1 && !no(vargs[0])) {
+			if (!is(vargs[0], sym_eq)) return ERROR_TYPE;
+			eq = true;
+		}
+		*result = make_table(eq);
+		return ERROR_OK;
+	}
+
+	/* maptable proc table
+	   Visits a sorted table in the order of its keys, and an imap as it was
+	   when maptable was called. */
+	error builtin_maptable(const std::vector<atom>& vargs, atom* result) {
+		long arg_len = vargs.size();
+		if (arg_len != 2) return ERROR_ARGS;
+		const atom& proc = vargs[0];
+		const atom& tbl = vargs[1];
+		if (tbl.type() == T_SORTED_TABLE) {
+			/* proc may add or remove keys, which moves entries between nodes, so
+			   the next entry is looked up by the key just visited */
+			auto& st = tbl.asp<sorted_table>();
+			std::vector<atom> v;
+			for (auto e = st.first(); e;) {
+				atom key = e.key();
+				v.clear();
+				v.push_back(key);
+				v.push_back(e.value());
+				error err = apply(proc, v, result);
+				if (err) return err;
+				e = st.ceiling(key);
+				if (e && !sorted_less(key, e.key())) e = e.next();
+			}
+			*result = tbl;
+			return ERROR_OK;
+		}
+		if (tbl.type() == T_IMAP) {
+			hamt h = tbl.asp<hamt>(); /* shares the nodes, which proc cannot change then */
+			std::vector<std::pair<atom, atom>> entries;
+			entries.reserve(h.size());
+			h.each([&](const atom& k, const atom& v) { entries.emplace_back(k, v); });
+			std::vector<atom> v;
+			for (auto& e : entries) {
+				v.clear();
+				v.push_back(e.first);
+				v.push_back(e.second);
+				error err = apply(proc, v, result);
+				if (err) return err;
+			}
+			*result = tbl;
+			return ERROR_OK;
+		}
+		if (tbl.type() != T_TABLE) return ERROR_TYPE;
+		auto& table1 = tbl.asp<table>();
+		std::vector<atom> v;
+		for (auto& p : table1) {
+			v.clear();
+			v.push_back(p.first);
+			v.push_back(p.second);
+			error err = apply(proc, v, result);
+			if (err) return err;
+		}
+		*result = tbl;
+		return ERROR_OK;
+	}
+
+	/* table-sref obj value index */
+	error builtin_table_sref(const std::vector<atom>& vargs, atom* result) {
+		atom index, obj, value;
+		if (vargs.size() != 3) return ERROR_ARGS;
+		obj = vargs[0];
+		if (obj.type() != T_TABLE) return ERROR_TYPE;
+		value = vargs[1];
+		index = vargs[2];
+		if (no(value)) obj.asp<table>().erase(index); /* as in Arc, nil removes the key */
+		else obj.asp<table>()[index] = value;
+		*result = value;
+		return ERROR_OK;
+	}
+
+	/* coerce obj type */
+	/*
+Coerces object to a new type.
+A char can be coerced to int, num, string, or sym.
+A number can be coerced to int, char, or string.
+A string can be coerced to sym, cons (char list), num, or int.
+A list of characters can be coerced to a string.
+A list can be coerced to a vector, and a vector to a list.
+A list or vector of numbers can be coerced to an f64array, and an f64array to a list or vector.
+A symbol can be coerced to a string.
+A string builder can be coerced to a string.
+	*/
+	error builtin_coerce(const std::vector<atom>& vargs, atom* result) {
+		atom obj, type;
+		if (vargs.size() != 2) return ERROR_ARGS;
+		obj = vargs[0];
+		type = vargs[1];
+		switch (obj.type()) {
+		case T_CHAR:
+			if (is(type, sym_int) || is(type, sym_num)) *result = make_number(obj.character());
+			else if (is(type, sym_string)) {
+				std::string s;
+				utf8_append(s, obj.character());
+				*result = make_string(std::move(s));
+			}
+			else if (is(type, sym_sym)) {
+				std::string s;
+				utf8_append(s, obj.character());
+				*result = make_sym(s);
+			}
+			else if (is(type, sym_char))
+				*result = obj;
+			else
+				return ERROR_TYPE;
+			break;
+		case T_NUM:
+			if (is(type, sym_int)) *result = obj.is_int() ? obj : make_integral(floor(obj.number()));
+			else if (is(type, sym_char)) {
+				/* a code point UTF-8 can encode */
+				double c = obj.number();
+				if (!(c >= 0 && c <= 0x10FFFF) || (c >= 0xD800 && c <= 0xDFFF)) return ERROR_RANGE;
+				*result = make_char((uint32_t)c);
+			}
+			else if (is(type, sym_string)) {
+				*result = make_string(to_string(obj, 0));
+			}
+			else if (is(type, sym_num))
+				*result = obj;
+			else
+				return ERROR_TYPE;
 			break;
 		case T_STRING:
 			if (is(type, sym_sym)) *result = make_sym(obj.asp<std::string>().c_str());
 			else if (is(type, sym_cons)) {
+				const std::string& v = obj.asp<std::string>();
+				std::vector<uint32_t> chars;
+				for (size_t i = 0; i < v.size();) {
+					chars.push_back(utf8_decode([&v](size_t j) { return v[j]; }, i, v.size(), &i));
+				}
 				*result = nil;
-				int i;
-				for (i = strlen(obj.asp<std::string>().c_str()) - 1; i >= 0; i--) {
-					*result = make_cons(make_char(obj.asp<std::string>().c_str()[i]), *result);
+				for (size_t i = chars.size(); i > 0; i--) {
+					*result = make_cons(make_char(chars[i - 1]), *result);
 				}
 			}
 			else if (is(type, sym_num)) *result = make_number(atof(obj.asp<std::string>().c_str()));
-			else if (is(type, sym_int)) *result = make_number(atoi(obj.asp<std::string>().c_str()));
+			else if (is(type, sym_int)) *result = parse_int(obj.asp<std::string>().c_str());
 			else if (is(type, sym_string))
 				*result = obj;
 			else
@@ -1648,6 +3237,10 @@ A symbol can be coerced to a string.
 				std::string s;
 				atom p;
 				for (p = obj; !no(p); p = cdr(p)) {
+					if (car(p).type() == T_CHAR) {
+						utf8_append(s, car(p).character());
+						continue;
+					}
 					atom x;
 					std::vector<atom> v; /* (car(p) string) */
 					v.push_back(car(p));
@@ -1656,13 +3249,64 @@ A symbol can be coerced to a string.
 					if (err) return err;
 					s += x.asp<std::string>();
 				}
-				*result = make_string(s);
+				*result = make_string(std::move(s));
 			}
 			else if (is(type, sym_cons))
 				*result = obj;
+			else if (is(type, sym_vector) && listp(obj))
+				*result = make_vector(atom_to_vector(obj));
+			else if (is(type, sym_f64array) && listp(obj))
+				return builtin_f64array(atom_to_vector(obj), result);
+			else
+				return ERROR_TYPE;
+			break;
+		case T_STRBUF:
+			if (is(type, sym_string)) *result = make_string(obj.asp<rope>().str());
+			else if (is(type, sym_strbuf)) *result = obj;
+			else return ERROR_TYPE;
+			break;
+		case T_VECTOR:
+			if (is(type, sym_cons)) {
+				auto& v = obj.asp<std::vector<atom>>();
+				*result = nil;
+				for (size_t i = v.size(); i > 0; i--) {
+					*result = make_cons(v[i - 1], *result);
+				}
+			}
+			else if (is(type, sym_vector))
+				*result = obj;
+			else if (is(type, sym_f64array))
+				return builtin_f64array(obj.asp<std::vector<atom>>(), result);
+			else
+				return ERROR_TYPE;
+			break;
+		case T_F64ARRAY: {
+			auto& v = obj.asp<std::vector<double>>();
+			if (is(type, sym_cons)) {
+				*result = nil;
+				for (size_t i = v.size(); i > 0; i--) {
+					*result = make_cons(make_number(v[i - 1]), *result);
+				}
+			}
+			else if (is(type, sym_vector)) {
+				std::vector<atom> r(v.size());
+				std::transform(v.begin(), v.end(), r.begin(), make_number);
+				*result = make_vector(std::move(r));
+			}
+			else if (is(type, sym_f64array))
+				*result = obj;
 			else
 				return ERROR_TYPE;
 			break;
+		}
+		case T_NIL:
+			if (is(type, sym_vector))
+				*result = make_vector({});
+			else if (is(type, sym_f64array))
+				*result = make_f64array({});
+			else
+				*result = obj;
+			break;
 		case T_SYM:
 			if (is(type, sym_string)) {
 				*result = make_string(to_string(obj, 0));
@@ -1678,6 +3322,141 @@ A symbol can be coerced to a string.
 		return ERROR_OK;
 	}
 
+	/* Sets order to the indexes of keys, stably ordered by less. The builtin < and > on
+	   keys that are all integers, all chars, all numbers or all strings compare them directly. */
+	error sort_order(const atom& less, const std::vector<atom>& keys, std::vector<size_t>& order) {
+		size_t n = keys.size();
+		order.resize(n);
+		for (size_t i = 0; i < n; i++) order[i] = i;
+		int dir = less.type() != T_BUILTIN ? 0 : less.fn() == builtin_less ? 1 : less.fn() == builtin_greater ? -1 : 0;
+		if (dir != 0 && n > 0) {
+			bool ints = true, chars = true, nums = true, strings = true;
+			for (auto& k : keys) {
+				if (k.type() != T_NUM) ints = nums = false;
+				else if (!k.is_int()) ints = false;
+				if (k.type() != T_CHAR) chars = false;
+				if (k.type() != T_STRING) strings = false;
+			}
+			if (ints || chars) {
+				std::vector<std::pair<int64_t, size_t>> v(n);
+				for (size_t i = 0; i < n; i++) v[i] = { ints ? keys[i].integer() : (int64_t)keys[i].character(), i };
+				if (dir > 0) std::stable_sort(v.begin(), v.end(), [](auto& a, auto& b) { return a.first < b.first; });
+				else std::stable_sort(v.begin(), v.end(), [](auto& a, auto& b) { return a.first > b.first; });
+				for (size_t i = 0; i < n; i++) order[i] = v[i].second;
+				return ERROR_OK;
+			}
+			if (nums) {
+				auto num_less = [&](size_t i, size_t j) {
+					return num_compare(keys[i], keys[j]) == -1;
+				};
+				if (dir > 0) std::stable_sort(order.begin(), order.end(), num_less);
+				else std::stable_sort(order.begin(), order.end(), [&](size_t i, size_t j) { return num_less(j, i); });
+				return ERROR_OK;
+			}
+			if (strings) {
+				std::vector<std::pair<const std::string*, size_t>> v(n);
+				for (size_t i = 0; i < n; i++) v[i] = { &keys[i].asp<std::string>(), i };
+				if (dir > 0) std::stable_sort(v.begin(), v.end(), [](auto& a, auto& b) { return *a.first < *b.first; });
+				else std::stable_sort(v.begin(), v.end(), [](auto& a, auto& b) { return *a.first > *b.first; });
+				for (size_t i = 0; i < n; i++) order[i] = v[i].second;
+				return ERROR_OK;
+			}
+		}
+
+		/* Any other less is applied, and may answer inconsistently (e.g. at random) or fail,
+		   so rather than std::stable_sort, which may then read past the ends, this merge sort
+		   only moves through ranges it has bounded: binary insertion into runs of 16, then
+		   std::merge of pairs of runs. After an error every comparison is false. */
+		error err = ERROR_OK;
+		std::vector<atom> args(2);
+		auto cmp = [&](size_t i, size_t j) {
+			if (err) return false;
+			args[0] = keys[i];
+			args[1] = keys[j];
+			atom r;
+			err = apply(less, args, &r);
+			return !err && !no(r);
+		};
+		const size_t run = 16;
+		for (size_t lo = 0; lo < n; lo += run) {
+			auto b = order.begin() + lo, e = order.begin() + std::min(n, lo + run);
+			for (auto p = b + 1; p < e; p++) {
+				std::rotate(std::upper_bound(b, p, *p, cmp), p, p + 1);
+			}
+		}
+		std::vector<size_t> merged(n);
+		for (size_t width = run; width < n; width *= 2) {
+			for (size_t lo = 0; lo < n; lo += 2 * width) {
+				size_t mid = std::min(n, lo + width), hi = std::min(n, lo + 2 * width);
+				std::merge(order.begin() + lo, order.begin() + mid, order.begin() + mid, order.begin() + hi, merged.begin() + lo, cmp);
+			}
+			order.swap(merged);
+		}
+		return err;
+	}
+
+	/* Returns a copy of seq, a list, a vector or anything else that coerces to and from a
+	   list, stably ordered by less applied to (key x) of each element x, or to x if key is nil. */
+	error sort_seq(const atom& seq, const atom& key, const atom& less, atom* result) {
+		std::vector<atom> items;
+		atom list = seq;
+		if (seq.type() == T_VECTOR) items = seq.asp<std::vector<atom>>();
+		else {
+			if (seq.type() != T_CONS && !no(seq)) {
+				error err = builtin_coerce({ seq, sym_cons }, &list);
+				if (err) return err;
+			}
+			for (; list.type() == T_CONS; list = cdr(list)) items.push_back(car(list));
+			if (!no(list)) return ERROR_TYPE;
+		}
+		std::vector<atom> keys;
+		if (!no(key)) {
+			keys.resize(items.size());
+			std::vector<atom> args(1);
+			for (size_t i = 0; i < items.size(); i++) {
+				args[0] = items[i];
+				error err = apply(key, args, &keys[i]);
+				if (err) return err;
+			}
+		}
+		std::vector<size_t> order;
+		error err = sort_order(less, no(key) ? items : keys, order);
+		if (err) return err;
+		std::vector<atom> sorted(items.size());
+		for (size_t i = 0; i < order.size(); i++) sorted[i] = std::move(items[order[i]]);
+		if (seq.type() == T_VECTOR) {
+			*result = make_vector(std::move(sorted));
+			return ERROR_OK;
+		}
+		list = nil;
+		for (size_t i = sorted.size(); i > 0; i--) list = make_cons(sorted[i - 1], list);
+		if (seq.type() == T_CONS || no(seq)) {
+			*result = list;
+			return ERROR_OK;
+		}
+		atom type;
+		err = builtin_type({ seq }, &type);
+		if (err) return err;
+		return builtin_coerce({ list, type }, result);
+	}
+
+	/* sort test seq
+	 * Returns a copy of the list, vector or string seq stably ordered by test.
+	 */
+	error builtin_sort(const std::vector<atom>& vargs, atom* result) {
+		if (vargs.size() != 2) return ERROR_ARGS;
+		return sort_seq(vargs[1], nil, vargs[0], result);
+	}
+
+	/* sort-by key seq [test]
+	 * Like sort, but compares (key x) of each element x, which is called once per element.
+	 * test defaults to <.
+	 */
+	error builtin_sort_by(const std::vector<atom>& vargs, atom* result) {
+		if (vargs.size() != 2 && vargs.size() != 3) return ERROR_ARGS;
+		return sort_seq(vargs[1], vargs[0], vargs.size() == 3 ? vargs[2] : make_builtin(builtin_less), result);
+	}
+
 	error builtin_flushout(const std::vector<atom>& vargs, atom* result) {
 		if (vargs.size() != 0) return ERROR_ARGS;
 		fflush(stdout);
@@ -1685,7 +3464,7 @@ A symbol can be coerced to a string.
 		return ERROR_OK;
 	}
 
-	error builtin_err(const std::vector<atom>& vargs, atom* result) {
+	error builtin_err(const std::vector<atom>& vargs, atom* /* result */) {
 		if (vargs.size() == 0) return ERROR_ARGS;
 		err_expr = nil;
 		size_t i;
@@ -1698,12 +3477,27 @@ A symbol can be coerced to a string.
 	error builtin_len(const std::vector<atom>& vargs, atom* result) {
 		if (vargs.size() != 1) return ERROR_ARGS;
 		atom a = vargs[0];
-		if (a.type == T_STRING) {
-			*result = make_number(strlen(a.asp<std::string>().c_str()));
+		if (a.type() == T_STRING) {
+			*result = make_number(((struct string_object*)a.obj())->length());
 		}
-		else if (a.type == T_TABLE) {
+		else if (a.type() == T_TABLE) {
 			*result = make_number(a.asp<table>().size());
 		}
+		else if (a.type() == T_VECTOR) {
+			*result = make_number(a.asp<std::vector<atom>>().size());
+		}
+		else if (a.type() == T_F64ARRAY) {
+			*result = make_number(a.asp<std::vector<double>>().size());
+		}
+		else if (a.type() == T_SORTED_TABLE) {
+			*result = make_number(a.asp<sorted_table>().size());
+		}
+		else if (a.type() == T_IMAP) {
+			*result = make_number(a.asp<hamt>().size());
+		}
+		else if (a.type() == T_STRBUF) {
+			*result = make_number(a.asp<rope>().chars());
+		}
 		else {
 			*result = make_number(len(a));
 		}
@@ -1711,19 +3505,21 @@ A symbol can be coerced to a string.
 	}
 
 	atom make_continuation(jmp_buf* jb) {
-		atom a;
-		a.type = T_CONTINUATION;
-		a.val = jb;
-		return a;
+		return atom(T_CONTINUATION, (uint64_t)(uintptr_t)jb);
 	}
 
 	error builtin_ccc(const std::vector<atom>& vargs, atom* result) {
 		if (vargs.size() != 1) return ERROR_ARGS;
 		atom a = vargs[0];
-		if (a.type != T_BUILTIN && a.type != T_CLOSURE) return ERROR_TYPE;
+		if (a.type() != T_BUILTIN && a.type() != T_CLOSURE) return ERROR_TYPE;
 		jmp_buf jb;
+		size_t roots = gc_roots.size();
+		int depth = eval_depth;
 		int val = setjmp(jb);
 		if (val) {
+			/* the jump skipped the destructors of the frames in between */
+			gc_roots.resize(roots);
+			eval_depth = depth;
 			*result = thrown;
 			return ERROR_OK;
 		}
@@ -1737,7 +3533,7 @@ A symbol can be coerced to a string.
 		if (vargs.size() != 2) return ERROR_ARGS;
 		atom a = vargs[0];
 		atom b = vargs[1];
-		if (a.type != T_STRING || b.type != T_STRING) return ERROR_TYPE;
+		if (a.type() != T_STRING || b.type() != T_STRING) return ERROR_TYPE;
 		*result = nil;
 		int r = rename(a.asp<std::string>().c_str(), b.asp<std::string>().c_str());
 		if (r != 0) {
@@ -1751,7 +3547,7 @@ A symbol can be coerced to a string.
 	error builtin_rmfile(const std::vector<atom>& vargs, atom* result) {
 		if (vargs.size() != 1) return ERROR_ARGS;
 		atom a = vargs[0];
-		if (a.type != T_STRING) return ERROR_TYPE;
+		if (a.type() != T_STRING) return ERROR_TYPE;
 		*result = nil;
 		int r = remove(a.asp<std::string>().c_str());
 		if (r != 0) {
@@ -1765,7 +3561,7 @@ A symbol can be coerced to a string.
 	error builtin_dir(const std::vector<atom>& vargs, atom* result) {
 		if (vargs.size() != 1) return ERROR_ARGS;
 		atom a = vargs[0];
-		if (a.type != T_STRING) return ERROR_TYPE;
+		if (a.type() != T_STRING) return ERROR_TYPE;
 		const std::string& path = a.asp<std::string>();
 		if (path.length() == 0) return ERROR_FILE;
 		*result = nil;
@@ -1780,7 +3576,7 @@ A symbol can be coerced to a string.
 	error builtin_dir_exists(const std::vector<atom>& vargs, atom* result) {
 		if (vargs.size() != 1) return ERROR_ARGS;
 		atom a = vargs[0];
-		if (a.type != T_STRING) return ERROR_TYPE;
+		if (a.type() != T_STRING) return ERROR_TYPE;
 		const std::string& path = a.asp<std::string>();
 		if (path.length() == 0) return ERROR_FILE;
 
@@ -1796,7 +3592,7 @@ A symbol can be coerced to a string.
 	error builtin_file_exists(const std::vector<atom>& vargs, atom* result) {
 		if (vargs.size() != 1) return ERROR_ARGS;
 		atom a = vargs[0];
-		if (a.type != T_STRING) return ERROR_TYPE;
+		if (a.type() != T_STRING) return ERROR_TYPE;
 		const std::string& path = a.asp<std::string>();
 		if (path.length() == 0) return ERROR_FILE;
 
@@ -1812,7 +3608,7 @@ A symbol can be coerced to a string.
 	error builtin_ensure_dir(const std::vector<atom>& vargs, atom* result) {
 		if (vargs.size() != 1) return ERROR_ARGS;
 		atom a = vargs[0];
-		if (a.type != T_STRING) return ERROR_TYPE;
+		if (a.type() != T_STRING) return ERROR_TYPE;
 		const std::string& path = a.asp<std::string>();
 		if (path.length() == 0) return ERROR_FILE;
 
@@ -1827,18 +3623,199 @@ A symbol can be coerced to a string.
 	error builtin_pipe_from(const std::vector<atom>& vargs, atom* result) {
 		if (vargs.size() != 1) return ERROR_ARGS;
 		atom a = vargs[0];
-		if (a.type != T_STRING) return ERROR_TYPE;
+		if (a.type() != T_STRING) return ERROR_TYPE;
 		FILE* fp = popen(vargs[0].asp<std::string>().c_str(), "r");
 		if (fp == nullptr) return ERROR_FILE;
 		*result = make_input_pipe(fp);
 		return ERROR_OK;
 	}
 
+	/* call-cache-stats
+	 * Returns a table of the hits and misses of the call site caches, and the number of monomorphic and polymorphic sites.
+	 * Only the tree-walking evaluator has these caches: the VM loads the cell of a global operator directly, so code it runs
+	 * counts nothing.
+	 */
+	error builtin_call_cache_stats(const std::vector<atom>& vargs, atom* result) {
+		if (vargs.size() != 0) return ERROR_ARGS;
+		*result = make_table();
+		auto& tbl = result->asp<table>();
+		tbl[make_sym("hits")] = make_number(call_stats.hits);
+		tbl[make_sym("misses")] = make_number(call_stats.misses);
+		tbl[make_sym("monomorphic")] = make_number(call_stats.monomorphic);
+		tbl[make_sym("polymorphic")] = make_number(call_stats.polymorphic);
+		return ERROR_OK;
+	}
+
+	/* gc-stats
+	 * Returns a table of the number of collections, the objects they freed, the seconds they took and the objects alive now,
+	 * and of the runs of the cycle collector, the objects and envs they freed, their total seconds and their longest pause.
+	 */
+	error builtin_gc_stats(const std::vector<atom>& vargs, atom* result) {
+		if (vargs.size() != 0) return ERROR_ARGS;
+		*result = make_table();
+		auto& tbl = result->asp<table>();
+		tbl[make_sym("collections")] = make_number(gc_stats.collections);
+		tbl[make_sym("freed")] = make_number(gc_stats.freed);
+		tbl[make_sym("objects")] = make_number(heap_objects.size());
+		tbl[make_sym("time")] = make_number(gc_stats.time);
+		tbl[make_sym("cycle-runs")] = make_number(gc_stats.cycle_runs);
+		tbl[make_sym("cycle-freed")] = make_number(gc_stats.cycle_freed);
+		tbl[make_sym("cycle-time")] = make_number(gc_stats.cycle_time);
+		tbl[make_sym("cycle-max-pause")] = make_number(gc_stats.cycle_max_pause);
+		return ERROR_OK;
+	}
+
+	/* pool-stats
+	 * Returns a table of the pools of cons, closure and env blocks. Each entry is a table of the block size, the pages, the blocks carved from them and the blocks in use.
+	 */
+	error builtin_pool_stats(const std::vector<atom>& vargs, atom* result) {
+		if (vargs.size() != 0) return ERROR_ARGS;
+		*result = make_table();
+		auto& tbl = result->asp<table>();
+		for (struct pool* p : { &cons_pool, &closure_pool, &env_pool }) {
+			atom entry = make_table();
+			auto& e = entry.asp<table>();
+			e[make_sym("size")] = make_number(p->size);
+			e[make_sym("pages")] = make_number(p->pages);
+			e[make_sym("blocks")] = make_number(p->blocks);
+			e[make_sym("used")] = make_number(p->used);
+			tbl[make_sym(p->name)] = entry;
+		}
+		return ERROR_OK;
+	}
+
 	/* end builtin */
 
+	/* builtin functions by global name */
+	const struct builtin_entry {
+		const char* name;
+		builtin fn;
+	} builtins[] = {
+		{ "car", builtin_car },
+		{ "cdr", builtin_cdr },
+		{ "cons", builtin_cons },
+		{ "+", builtin_add },
+		{ "-", builtin_subtract },
+		{ "*", builtin_multiply },
+		{ "/", builtin_divide },
+		{ "<", builtin_less },
+		{ ">", builtin_greater },
+		{ "apply", builtin_apply },
+		{ "is", builtin_is },
+		{ "scar", builtin_scar },
+		{ "scdr", builtin_scdr },
+		{ "mod", builtin_mod },
+		{ "type", builtin_type },
+		{ "string-sref", builtin_string_sref },
+		{ "writeb", builtin_writeb },
+		{ "expt", builtin_expt },
+		{ "log", builtin_log },
+		{ "sqrt", builtin_sqrt },
+		{ "readline", builtin_readline },
+		{ "quit", builtin_quit },
+		{ "rand", builtin_rand },
+		{ "read", builtin_read },
+		{ "macex", builtin_macex },
+		{ "string", builtin_string },
+		{ "sym", builtin_sym },
+		{ "uniq", builtin_uniq },
+		{ "system", builtin_system },
+		{ "eval", builtin_eval },
+		{ "load", builtin_load },
+		{ "int", builtin_int },
+		{ "trunc", builtin_trunc },
+		{ "sin", builtin_sin },
+		{ "cos", builtin_cos },
+		{ "tan", builtin_tan },
+		{ "bound", builtin_bound },
+		{ "infile", builtin_infile },
+		{ "outfile", builtin_outfile },
+		{ "close", builtin_close },
+		{ "disp", builtin_disp },
+		{ "readb", builtin_readb },
+		{ "sread", builtin_sread },
+		{ "write", builtin_write },
+		{ "newstring", builtin_newstring },
+		{ "table", builtin_table },
+		{ "maptable", builtin_maptable },
+		{ "table-sref", builtin_table_sref },
+		{ "coerce", builtin_coerce },
+		{ "flushout", builtin_flushout },
+		{ "err", builtin_err },
+		{ "len", builtin_len },
+		{ "ccc", builtin_ccc },
+		{ "mvfile", builtin_mvfile },
+		{ "rmfile", builtin_rmfile },
+		{ "dir", builtin_dir },
+		{ "pipe-from", builtin_pipe_from },
+		{ "dir-exists", builtin_dir_exists },
+		{ "file-exists", builtin_file_exists },
+		{ "ensure-dir", builtin_ensure_dir },
+		{ "call-cache-stats", builtin_call_cache_stats },
+		{ "gc-stats", builtin_gc_stats },
+		{ "pool-stats", builtin_pool_stats },
+		{ "vector", builtin_vector },
+		{ "newvector", builtin_newvector },
+		{ "vector-sref", builtin_vector_sref },
+		{ "f64array", builtin_f64array },
+		{ "newf64array", builtin_newf64array },
+		{ "f64array-sref", builtin_f64array_sref },
+		{ "f64array-sum", builtin_f64array_sum },
+		{ "f64array-dot", builtin_f64array_dot },
+		{ "f64array-min", builtin_f64array_min },
+		{ "f64array-max", builtin_f64array_max },
+		{ "sorted-table", builtin_sorted_table },
+		{ "sorted-table-sref", builtin_sorted_table_sref },
+		{ "sorted-table-first", builtin_sorted_table_first },
+		{ "sorted-table-last", builtin_sorted_table_last },
+		{ "sorted-table-floor", builtin_sorted_table_floor },
+		{ "sorted-table-ceiling", builtin_sorted_table_ceiling },
+		{ "sorted-table-range", builtin_sorted_table_range },
+		{ "imap", builtin_imap },
+		{ "imap-assoc", builtin_imap_assoc },
+		{ "imap-dissoc", builtin_imap_dissoc },
+		{ "imap-sref", builtin_imap_sref },
+		{ "transient", builtin_transient },
+		{ "persistent", builtin_persistent },
+		{ "strbuf", builtin_strbuf },
+		{ "strbuf-add", builtin_strbuf_add },
+		{ "sort", builtin_sort },
+		{ "sort-by", builtin_sort_by },
+	};
+
+
+	/* appends a as disp prints it */
+	void append_display(std::string& s, const atom& a) {
+		switch (a.type()) {
+		case T_STRING:
+			s += a.asp<std::string>();
+			break;
+		case T_CHAR:
+			utf8_append(s, a.character());
+			break;
+		case T_STRBUF:
+			a.asp<rope>().each_chunk([&](std::string_view c) { s += c; });
+			break;
+		default:
+			s += to_string(a, 0);
+		}
+	}
+
+	/* prints a like to_string, writing a string or builder out as it is */
+	void print_atom(FILE* fp, const atom& a, int write) {
+		if (a.type() != T_STRING && a.type() != T_STRBUF) {
+			fputs(to_string(a, write).c_str(), fp);
+			return;
+		}
+		if (write) fputc('"', fp);
+		if (a.type() == T_STRING) fwrite(a.asp<std::string>().data(), 1, a.asp<std::string>().size(), fp);
+		else a.asp<rope>().each_chunk([&](std::string_view c) { fwrite(c.data(), 1, c.size(), fp); });
+		if (write) fputc('"', fp);
+	}
+
 	std::string to_string(atom a, int write) {
 		std::string s;
-		switch (a.type) {
+		switch (a.type()) {
 		case T_NIL:
 			s = "nil";
 			break;
@@ -1864,7 +3841,7 @@ A symbol can be coerced to a string.
 			s = "(" + to_string(car(a), write);
 			a = cdr(a);
 			while (!no(a)) {
-				if (a.type == T_CONS) {
+				if (a.type() == T_CONS) {
 					s += " " + to_string(car(a), write);
 					a = cdr(a);
 				}
@@ -1877,7 +3854,7 @@ A symbol can be coerced to a string.
 			break;
 		}
 		case T_SYM:
-			s = str_of_sym[std::get<sym>(a.val)];
+			s = sym_name(a.symbol());
 			break;
 		case T_STRING:
 			if (write) s += "\"";
@@ -1886,27 +3863,32 @@ A symbol can be coerced to a string.
 			break;
 		case T_NUM:
 		{
+			if (a.is_int()) {
+				s = std::to_string(a.integer());
+				break;
+			}
 			std::stringstream ss;
-			ss << std::setprecision(16) << std::get<double>(a.val);
+			ss << std::setprecision(16) << a.number();
 			s = ss.str();
 			break;
 		}
 		case T_BUILTIN:
 		{
 			std::stringstream ss;
-			ss << "#<builtin:" << (void*)std::get<builtin>(a.val) << ">";
+			ss << "#<builtin:" << (void*)a.fn() << ">";
 			s = ss.str();
 			break;
 		}
 		case T_CLOSURE:
 		{
-			atom a2 = make_cons(sym_fn, make_cons(a.asp<struct closure>().args, a.asp<struct closure>().body));
+			const struct lambda& fn = *a.asp<struct closure>().fn;
+			atom a2 = make_cons(sym_fn, make_cons(fn.args, fn.body));
 			s = "#<closure>" + to_string(a2, 1);
 			break;
 		}
 		case T_MACRO:
-			s = "#<macro:" + to_string(a.asp<struct closure>().args, write) +
-				" " + to_string(a.asp<struct closure>().body, write) + ">";
+			s = "#<macro:" + to_string(a.asp<struct closure>().fn->args, write) +
+				" " + to_string(a.asp<struct closure>().fn->body, write) + ">";
 			break;
 		case T_INPUT:
 			s = "#<input>";
@@ -1924,22 +3906,58 @@ A symbol can be coerced to a string.
 			}
 			s += ")>";
 			break; }
+		case T_VECTOR: {
+			s = "#(";
+			const char* sep = "";
+			for (auto& x : a.asp<std::vector<atom>>()) {
+				s += sep + to_string(x, write);
+				sep = " ";
+			}
+			s += ")";
+			break; }
+		case T_STRBUF:
+			if (write) s += "\"";
+			s += a.asp<rope>().str();
+			if (write) s += "\"";
+			break;
+		case T_IMAP:
+			s = "#<imap:(";
+			a.asp<hamt>().each([&](const atom& k, const atom& v) {
+				s += "(" + to_string(k, write) + " . " + to_string(v, write) + ")";
+			});
+			s += ")>";
+			break;
+		case T_SORTED_TABLE:
+			s = "#<sorted-table:(";
+			a.asp<sorted_table>().each([&](const atom& k, const atom& v) {
+				s += "(" + to_string(k, write) + " . " + to_string(v, write) + ")";
+			});
+			s += ")>";
+			break;
+		case T_F64ARRAY: {
+			s = "#<f64array:(";
+			const char* sep = "";
+			for (double x : a.asp<std::vector<double>>()) {
+				s += sep + to_string(make_number(x), write);
+				sep = " ";
+			}
+			s += ")>";
+			break; }
 		case T_CHAR:
 			if (write) {
 				s += "#\\";
-				switch (std::get<char>(a.val)) {
+				switch (a.character()) {
 				case '\0': s += "nul"; break;
 				case '\r': s += "return"; break;
 				case '\n': s += "newline"; break;
 				case '\t': s += "tab"; break;
 				case ' ': s += "space"; break;
 				default:
-					s += std::get<char>(a.val);
+					utf8_append(s, a.character());
 				}
 			}
 			else {
-				s[0] = std::get<char>(a.val);
-				s[1] = '\0';
+				utf8_append(s, a.character());
 			}
 			break;
 		case T_CONTINUATION:
@@ -1952,16 +3970,33 @@ A symbol can be coerced to a string.
 		return s;
 	}
 
-	atom make_table() {
-		atom a;
-		a.type = T_TABLE;
-		a.val = std::make_shared<table>();
-		return a;
+	atom make_table(bool eq) {
+		return atom(T_TABLE, new table_object(eq));
 	}
 
-	char* slurp_fp(FILE* fp) {
+	atom make_vector(std::vector<atom> v) {
+		return atom(T_VECTOR, new vector_object(std::move(v)));
+	}
+
+	atom make_sorted_table() {
+		return atom(T_SORTED_TABLE, new sorted_table_object);
+	}
+
+	atom make_strbuf() {
+		return atom(T_STRBUF, new strbuf_object);
+	}
+
+	atom make_imap(const hamt& value, bool transient) {
+		return atom(T_IMAP, new imap_object(value, transient));
+	}
+
+	atom make_f64array(std::vector<double> v) {
+		return atom(T_F64ARRAY, new f64array_object(std::move(v)));
+	}
+
+	char* slurp_fp(FILE* fp) {
 		char* buf;
-		size_t len;
+		long len;
 
 		fseek(fp, 0, SEEK_END);
 		len = ftell(fp);
@@ -1972,7 +4007,10 @@ A symbol can be coerced to a string.
 		if (!buf)
 			return NULL;
 
-		if (fread(buf, 1, len, fp) != len) return NULL;
+		if (fread(buf, 1, len, fp) != (size_t)len) {
+			free(buf);
+			return NULL;
+		}
 		buf[len] = 0;
 
 		return buf;
@@ -1996,7 +4034,7 @@ A symbol can be coerced to a string.
 
 		err_expr = expr;
 
-		if (expr.type != T_CONS || !listp(expr)) {
+		if (expr.type() != T_CONS || !listp(expr)) {
 			*result = expr;
 			return ERROR_OK;
 		}
@@ -2004,7 +4042,7 @@ A symbol can be coerced to a string.
 			atom op = car(expr);
 
 			/* Handle quote */
-			if (op.type == T_SYM && std::get<sym>(op.val) == std::get<sym>(sym_quote.val)) {
+			if (op.type() == T_SYM && op.symbol() == sym_quote.symbol()) {
 				*result = expr;
 				return ERROR_OK;
 			}
@@ -2012,11 +4050,11 @@ A symbol can be coerced to a string.
 			atom args = cdr(expr);
 
 			/* Is it a macro? */
-			if (op.type == T_SYM && !env_get(global_env, std::get<sym>(op.val), result) && result->type == T_MACRO) {
+			if (op.type() == T_SYM && !global_get(global_cell(op.symbol()), result) && result->type() == T_MACRO) {
 				/* Evaluate operator */
 				op = *result;
 
-				op.type = T_CLOSURE;
+				op.set_type(T_CLOSURE);
 
 				atom result2;
 				std::vector<atom> vargs = atom_to_vector(args);
@@ -2046,20 +4084,540 @@ A symbol can be coerced to a string.
 		}
 	}
 
+	/* garbage collector */
+
+	/* Reference counts free an object as soon as it is dropped, but not a cycle,
+	   such as a closure assigned into the environment it closes over. Between
+	   top-level forms, where no C++ frame holds an atom except those registered
+	   with gc_root, the collector marks what the roots reach and frees the rest.
+	   While a form runs, gc_collect_running finds the roots from the counts. */
+
+	unsigned gc_epoch = 0; /* incremented by each collection */
+	std::vector<uint8_t> gc_marks; /* by object index */
+	std::vector<struct object*> gc_gray; /* marked objects whose fields are not marked yet */
+
+	gc_root::gc_root(const atom* a) {
+		gc_roots.push_back(a);
+	}
+
+	gc_root::~gc_root() {
+		gc_roots.pop_back();
+	}
+
+	void gc_mark_object(struct object* o) {
+		if (gc_marks[o->index]) return;
+		gc_marks[o->index] = 1;
+		gc_gray.push_back(o);
+	}
+
+	void gc_mark(const atom& a) {
+		if (a.heap()) gc_mark_object(a.obj());
+	}
+
+	void gc_mark_env(struct env* e) {
+		for (; e && e->gc_epoch != gc_epoch; e = e->parent.get()) {
+			e->gc_epoch = gc_epoch;
+			for (auto& a : e->slots) gc_mark(a);
+		}
+	}
+
+	void gc_mark_lambda(struct lambda* l);
+
+	void gc_mark_chunk(const struct chunk* ch) {
+		if (!ch) return;
+		for (auto& a : ch->consts) gc_mark(a);
+		for (auto& f : ch->fns) gc_mark_lambda(f.get());
+	}
+
+	void gc_mark_node(const struct node* n) {
+		gc_mark(n->value);
+		for (auto& k : n->kids) gc_mark_node(k.get());
+		if (n->fn) gc_mark_lambda(n->fn.get());
+	}
+
+	void gc_mark_pattern(const struct pattern* p) {
+		if (!p) return;
+		if (p->dflt) gc_mark_node(p->dflt.get());
+		gc_mark_chunk(p->compiled.get());
+		gc_mark_pattern(p->car.get());
+		gc_mark_pattern(p->cdr.get());
+	}
+
+	/* the keys and values of a trie; nodes shared by maps are marked once */
+	void gc_mark_hamt(const hamt::node* n) {
+		if (!n || n->gc_epoch == gc_epoch) return;
+		const_cast<hamt::node*>(n)->gc_epoch = gc_epoch;
+		for (auto& e : n->entries) {
+			gc_mark(e.first);
+			gc_mark(e.second);
+		}
+		for (auto c : n->children) gc_mark_hamt(c);
+	}
+
+	/* the constants of the code of a lambda */
+	void gc_mark_lambda(struct lambda* l) {
+		if (l->gc_epoch == gc_epoch) return;
+		l->gc_epoch = gc_epoch;
+		gc_mark(l->args);
+		gc_mark(l->body);
+		gc_mark_pattern(l->params.get());
+		for (auto& n : l->code) gc_mark_node(n.get());
+		gc_mark_chunk(l->compiled.get());
+	}
+
+	/* marks the fields of the gray objects until there are none */
+	void gc_trace() {
+		while (!gc_gray.empty()) {
+			struct object* o = gc_gray.back();
+			gc_gray.pop_back();
+			switch (o->kind) {
+			case T_CONS: {
+				struct cons* c = (struct cons*)o;
+				gc_mark(c->car);
+				gc_mark(c->cdr);
+				break;
+			}
+			case T_CLOSURE: {
+				struct closure* c = (struct closure*)o;
+				gc_mark_env(c->parent_env.get());
+				gc_mark_lambda(c->fn.get());
+				break;
+			}
+			case T_TABLE:
+				for (auto& p : ((struct table_object*)o)->value) {
+					gc_mark(p.first);
+					gc_mark(p.second);
+				}
+				break;
+			case T_VECTOR:
+				for (auto& a : ((struct vector_object*)o)->value) gc_mark(a);
+				break;
+			case T_SORTED_TABLE:
+				((struct sorted_table_object*)o)->value.each([](const atom& k, const atom& v) {
+					gc_mark(k);
+					gc_mark(v);
+				});
+				break;
+			case T_IMAP:
+				gc_mark_hamt(((struct imap_object*)o)->value.top());
+				break;
+			default:
+				break;
+			}
+		}
+	}
+
+	/* drops the fields of a garbage object */
+	void gc_clear(struct object* o) {
+		switch (o->kind) {
+		case T_CONS: {
+			struct cons* c = (struct cons*)o;
+			c->car = nil;
+			c->cdr = nil;
+			break;
+		}
+		case T_CLOSURE: {
+			struct closure* c = (struct closure*)o;
+			c->parent_env.reset();
+			c->fn.reset();
+			break;
+		}
+		case T_TABLE:
+			((struct table_object*)o)->value.clear();
+			break;
+		case T_VECTOR:
+			((struct vector_object*)o)->value.clear();
+			break;
+		case T_SORTED_TABLE:
+			((struct sorted_table_object*)o)->value.clear();
+			break;
+		case T_IMAP:
+			((struct imap_object*)o)->value.clear();
+			break;
+		default:
+			break;
+		}
+	}
+
+	/* Drops references of the collectors to envs, without buffering them again.
+	   Only a decrement from the program suggests a new cycle. */
+	void cycle_release(std::vector<env_ptr>& envs) {
+		for (auto& e : envs) {
+			struct env* p = e.p;
+			e.p = nullptr;
+			p->buffered = false;
+			if (--p->refs == 0) env_ptr::destroy(p);
+		}
+		envs.clear();
+	}
+
+	void gc_collect() {
+		auto start = std::chrono::steady_clock::now();
+		/* The candidates hold envs the collector may free under them. Buffering
+		   stays off, since a garbage env buffered would keep pointing to the
+		   objects freed below; a live env that loses a reference from garbage is
+		   not left in a new cycle. */
+		cycle_buffering = false;
+		std::vector<env_ptr> candidates;
+		candidates.swap(cycle_candidates);
+		cycle_release(candidates);
+		gc_epoch++;
+		gc_marks.assign(heap_objects.size(), 0);
+		for (auto& c : global_cells) {
+			gc_mark(c.value);
+			gc_mark(c.name);
+		}
+		gc_mark_env(global_env.get());
+		gc_mark(err_expr);
+		gc_mark(thrown);
+		for (auto a : gc_roots) gc_mark(*a);
+		/* queued objects still hold their fields until they are freed */
+		for (auto o : free_queue) gc_mark_object(o);
+		gc_trace();
+
+		/* Hold the garbage while clearing its fields, so that no object is freed
+		   while another still points to it, then free it all. A count left after
+		   clearing comes from other garbage or was lost by a continuation jump. */
+		std::vector<struct object*> garbage;
+		for (size_t i = 0; i < heap_objects.size(); i++) {
+			if (!gc_marks[i]) {
+				heap_objects[i]->refs++;
+				garbage.push_back(heap_objects[i]);
+			}
+		}
+		for (auto o : garbage) gc_clear(o);
+		for (auto o : garbage) free_object(o);
+		cycle_buffering = true;
+		gc_stats.collections++;
+		gc_stats.freed += garbage.size();
+		gc_stats.time += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	/* cycle collector */
+
+	/* Trial deletion (Bacon and Rajan) over the envs buffered by possible_cycle.
+	   It subtracts the references among the envs, closures, conses and tables
+	   reachable from the candidates. What keeps a count above zero is referenced
+	   from outside, so it and everything it reaches is live. The rest is a
+	   garbage cycle. Unlike gc_collect, it needs no roots: references from C++
+	   frames are counted like any other. Strings cannot be in a cycle and lambdas
+	   are taken as outside references, so neither is traversed. */
+
+	/* Frees the candidates that only the buffer still holds. They have no
+	   cycle, and a form that runs for long would otherwise keep every env it
+	   buffered until gc_poll collects the candidates. */
+	void cycle_purge() {
+		std::vector<env_ptr> dead;
+		size_t n = 0;
+		for (auto& e : cycle_candidates) {
+			if (e->refs == 1) {
+				e->buffered = false;
+				dead.push_back(std::move(e));
+			}
+			else cycle_candidates[n++] = std::move(e);
+		}
+		cycle_candidates.resize(n);
+		cycle_purge_at = std::max(cycle_purge_min, 2 * n);
+		dead.clear(); /* may buffer other envs */
+	}
+
+	const size_t cycle_step = 1024; /* candidates per safe point */
+	const size_t cycle_max_nodes = 256 * 1024; /* traversal limit of a run; past it, everything is taken as live */
+
+	/* an env, tagged with the low bit, or an object */
+	typedef uintptr_t cycle_node;
+
+	struct cycle_state {
+		int64_t count; /* references from outside the traversed graph */
+		bool live = false;
+	};
+
+	bool cycle_is_env(cycle_node n) {
+		return n & 1;
+	}
+
+	struct env* cycle_env(cycle_node n) {
+		return (struct env*)(n & ~(uintptr_t)1);
+	}
+
+	struct object* cycle_object(cycle_node n) {
+		return (struct object*)n;
+	}
+
+	uint32_t cycle_refs(cycle_node n) {
+		return cycle_is_env(n) ? cycle_env(n)->refs : cycle_object(n)->refs;
+	}
+
+	template <typename F>
+	void cycle_child(const atom& a, F f) {
+		if (a.heap() && a.obj()->kind != T_STRING && a.obj()->kind != T_F64ARRAY && a.obj()->kind != T_STRBUF && a.obj()->kind != T_NUM) {
+			f((cycle_node)a.obj());
+		}
+	}
+
+	/* Calls cycle_child on the keys and values of the nodes that hold one
+	   reference. A shared node counts one reference for all the maps that hold
+	   it, so the collector leaves it and what it holds alone. */
+	template <typename F>
+	void cycle_hamt_children(const hamt::node* n, F f) {
+		if (!n || n->refs > 1) return;
+		for (auto& e : n->entries) {
+			cycle_child(e.first, f);
+			cycle_child(e.second, f);
+		}
+		for (auto c : n->children) cycle_hamt_children(c, f);
+	}
+
+	/* calls f on each traversed node n points to */
+	template <typename F>
+	void cycle_children(cycle_node n, F f) {
+		if (cycle_is_env(n)) {
+			struct env* e = cycle_env(n);
+			if (e->parent) f((cycle_node)e->parent.get() | 1);
+			for (auto& a : e->slots) cycle_child(a, f);
+			return;
+		}
+		struct object* o = cycle_object(n);
+		switch (o->kind) {
+		case T_CONS:
+			cycle_child(((struct cons*)o)->car, f);
+			cycle_child(((struct cons*)o)->cdr, f);
+			break;
+		case T_CLOSURE: {
+			struct closure* c = (struct closure*)o;
+			if (c->parent_env) f((cycle_node)c->parent_env.get() | 1);
+			break; /* its lambda holds code, not data */
+		}
+		case T_TABLE:
+			for (auto& p : ((struct table_object*)o)->value) {
+				cycle_child(p.first, f);
+				cycle_child(p.second, f);
+			}
+			break;
+		case T_VECTOR:
+			for (auto& a : ((struct vector_object*)o)->value) cycle_child(a, f);
+			break;
+		case T_SORTED_TABLE: /* keys are numbers and strings */
+			((struct sorted_table_object*)o)->value.each([&](const atom&, const atom& v) { cycle_child(v, f); });
+			break;
+		case T_IMAP:
+			cycle_hamt_children(((struct imap_object*)o)->value.top(), f);
+			break;
+		default:
+			break;
+		}
+	}
+
+	/* frees the cycles among up to budget candidates */
+	void cycle_collect(size_t budget) {
+		auto start = std::chrono::steady_clock::now();
+		size_t n = std::min(budget, cycle_candidates.size());
+		std::vector<env_ptr> roots(std::make_move_iterator(cycle_candidates.end() - n), std::make_move_iterator(cycle_candidates.end()));
+		cycle_candidates.resize(cycle_candidates.size() - n);
+		for (auto& e : roots) e->buffered = false;
+
+		/* subtract the references within the graph */
+		std::unordered_map<cycle_node, struct cycle_state> graph;
+		std::vector<cycle_node> stack;
+		bool complete = true;
+		for (auto& e : roots) {
+			cycle_node r = (cycle_node)e.get() | 1;
+			if (graph.emplace(r, cycle_state{ cycle_refs(r) }).second) stack.push_back(r);
+			graph[r].count--; /* held by roots */
+		}
+		while (!stack.empty() && complete) {
+			cycle_node x = stack.back();
+			stack.pop_back();
+			cycle_children(x, [&](cycle_node c) {
+				auto it = graph.emplace(c, cycle_state{ cycle_refs(c) });
+				if (it.second) stack.push_back(c);
+				it.first->second.count--;
+			});
+			complete = graph.size() <= cycle_max_nodes;
+		}
+
+		/* what is referenced from outside is live, with all it reaches */
+		std::vector<struct object*> objects;
+		std::vector<env_ptr> envs;
+		if (complete) {
+			for (auto& p : graph) {
+				if (p.second.count <= 0 || p.second.live) continue;
+				p.second.live = true;
+				stack.push_back(p.first);
+				while (!stack.empty()) {
+					cycle_node x = stack.back();
+					stack.pop_back();
+					cycle_children(x, [&](cycle_node c) {
+						struct cycle_state& s = graph[c];
+						if (!s.live) {
+							s.live = true;
+							stack.push_back(c);
+						}
+					});
+				}
+			}
+			for (auto& p : graph) {
+				if (p.second.live) continue;
+				if (cycle_is_env(p.first)) {
+					envs.emplace_back(cycle_env(p.first));
+					envs.back()->buffered = true; /* not a candidate while it is cleared */
+				}
+				else {
+					cycle_object(p.first)->refs++;
+					objects.push_back(cycle_object(p.first));
+				}
+			}
+		}
+
+		/* clear the garbage so that it is freed by its counts */
+		for (auto& e : envs) {
+			e->parent.reset();
+			e->slots.clear();
+		}
+		for (auto o : objects) gc_clear(o);
+		for (auto o : objects) {
+			if (--o->refs == 0) free_object(o);
+		}
+		gc_stats.cycle_freed += objects.size() + envs.size();
+		cycle_release(envs);
+		cycle_release(roots);
+
+		double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		gc_stats.cycle_runs++;
+		gc_stats.cycle_time += t;
+		gc_stats.cycle_max_pause = std::max(gc_stats.cycle_max_pause, t);
+	}
+
+	/* Frees the garbage of the whole heap while a form runs, when C++ frames
+	   hold atoms that gc_collect cannot see. It is trial deletion over every
+	   object: a count above the references from the traversed objects and envs
+	   comes from outside them, such as a frame, a cell, a lambda or a shared
+	   trie node, and makes a root. Queued objects are roots as in gc_collect. */
+	void gc_collect_running() {
+		auto start = std::chrono::steady_clock::now();
+		std::vector<int64_t> counts(heap_objects.size());
+		for (size_t i = 0; i < heap_objects.size(); i++) counts[i] = heap_objects[i]->refs;
+		std::unordered_map<struct env*, struct cycle_state> envs;
+		std::vector<cycle_node> stack;
+
+		/* subtract the references among the objects and the envs they reach */
+		auto subtract = [&](cycle_node c) {
+			if (cycle_is_env(c)) {
+				auto it = envs.emplace(cycle_env(c), cycle_state{ cycle_refs(c) });
+				if (it.second) stack.push_back(c);
+				it.first->second.count--;
+			}
+			else counts[cycle_object(c)->index]--;
+		};
+		for (auto o : heap_objects) cycle_children((cycle_node)o, subtract);
+		while (!stack.empty()) {
+			cycle_node x = stack.back();
+			stack.pop_back();
+			cycle_children(x, subtract);
+		}
+
+		/* mark what the roots reach */
+		gc_marks.assign(heap_objects.size(), 0);
+		for (auto o : free_queue) counts[o->index] = 1;
+		auto mark = [&](cycle_node c) {
+			if (cycle_is_env(c)) {
+				struct cycle_state& s = envs[cycle_env(c)];
+				if (s.live) return;
+				s.live = true;
+			}
+			else {
+				uint8_t& m = gc_marks[cycle_object(c)->index];
+				if (m) return;
+				m = 1;
+			}
+			stack.push_back(c);
+		};
+		for (size_t i = 0; i < heap_objects.size(); i++) {
+			if (counts[i] > 0) mark((cycle_node)heap_objects[i]);
+		}
+		for (auto& p : envs) {
+			if (p.second.count > 0) mark((cycle_node)p.first | 1);
+		}
+		while (!stack.empty()) {
+			cycle_node x = stack.back();
+			stack.pop_back();
+			cycle_children(x, mark);
+		}
+
+		/* clear the garbage so that it is freed by its counts, as cycle_collect does */
+		std::vector<struct object*> garbage;
+		std::vector<env_ptr> dead;
+		for (size_t i = 0; i < heap_objects.size(); i++) {
+			if (!gc_marks[i]) {
+				heap_objects[i]->refs++;
+				garbage.push_back(heap_objects[i]);
+			}
+		}
+		for (auto& p : envs) {
+			if (p.second.live) continue;
+			dead.emplace_back(p.first);
+			dead.back()->buffered = true; /* not a candidate while it is cleared; a buffered one would be live */
+		}
+		for (auto& e : dead) {
+			e->parent.reset();
+			e->slots.clear();
+		}
+		for (auto o : garbage) gc_clear(o);
+		for (auto o : garbage) {
+			if (--o->refs == 0) free_object(o);
+		}
+		gc_stats.collections++;
+		gc_stats.freed += garbage.size() + dead.size();
+		cycle_release(dead);
+		gc_stats.time += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	/* Frees a step of the queued objects and of the cycle candidates, and
+	   collects if the heap has doubled since the last collection. */
+	void gc_safe_point() {
+		if (eval_depth > 0) return;
+		free_pending(safe_point_free_step);
+		if (!cycle_candidates.empty()) cycle_collect(cycle_step);
+		if (heap_objects.size() < gc_threshold) return;
+		gc_collect();
+		gc_threshold = std::max(gc_min_threshold, 2 * heap_objects.size());
+	}
+
+	/* Collects the cycles of the candidates when enough are buffered, waiting
+	   for twice as many after a run that freed nothing, and the whole heap when
+	   it has doubled since the last collection. */
+	void gc_poll_collect() {
+		if (cycle_candidates.size() >= cycle_poll_at) cycle_purge(); /* cheaper, for the candidates with no cycle */
+		if (cycle_candidates.size() >= cycle_poll_at) {
+			unsigned long freed = gc_stats.cycle_freed;
+			cycle_collect(cycle_candidates.size());
+			cycle_poll_at = gc_stats.cycle_freed > freed ? cycle_purge_min : 2 * cycle_poll_at;
+		}
+		if (heap_objects.size() >= gc_threshold) {
+			gc_collect_running();
+			gc_threshold = std::max(gc_min_threshold, 2 * heap_objects.size());
+		}
+	}
+
 	error macex_eval(atom expr, atom* result) {
 		atom expr2;
+		eval_depth++;
 		error err = macex(expr, &expr2);
-		if (err) return err;
-		/*printf("expanded: ");
-		print_expr(expr2);
-		puts("");*/
-		return eval_expr(expr2, global_env, result);
+		if (!err) {
+			/*printf("expanded: ");
+			print_expr(expr2);
+			puts("");*/
+			err = eval_expr(expr2, global_env, result);
+		}
+		eval_depth--;
+		return err;
 	}
 
 	error load_string(const char* text) {
 		error err = ERROR_OK;
 		const char* p = text;
-		atom expr;
+		atom expr, result;
+		gc_root expr_root(&expr), result_root(&result);
 		while (*p) {
 			if (isspace(*p)) {
 				p++;
@@ -2075,12 +4633,12 @@ A symbol can be coerced to a string.
 				err_expr = expr;
 				break;
 			}
-			atom result;
 			err = macex_eval(expr, &result);
 			if (err) {
 				err_expr = expr;
 				break;
 			}
+			gc_safe_point();
 			//else {
 			//	print_expr(result);
 			//	putchar(' ');
@@ -2106,187 +4664,820 @@ A symbol can be coerced to a string.
 		}
 	}
 
-	error eval_expr(atom expr, std::shared_ptr<struct env> env, atom* result)
+	/* lexical scope used while analyzing a fn body; vars are the slots of its frames */
+	struct scope {
+		struct scope* parent;
+		std::vector<sym> vars;
+	};
+
+	/* finds the frame depth and slot index of a lexically bound variable */
+	bool scope_resolve(const struct scope* sc, sym s, int* depth, int* index) {
+		int d;
+		for (d = 0; sc != nullptr; sc = sc->parent, d++) {
+			int i;
+			for (i = (int)sc->vars.size() - 1; i >= 0; i--) {
+				if (sc->vars[i] == s) {
+					*depth = d;
+					*index = i;
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
+	int scope_declare(struct scope* sc, sym s) {
+		sc->vars.push_back(s);
+		return (int)sc->vars.size() - 1;
+	}
+
+	node_ptr make_error_node(error err) {
+		node_ptr n = std::make_unique<struct node>(N_ERROR);
+		n->err = err;
+		return n;
+	}
+
+	pattern::pattern(enum pattern_type type) : type(type) {}
+
+	/* resolves a destructuring argument to slots. A default sees only the arguments bound before it. */
+	std::unique_ptr<struct pattern> analyze_pattern(atom arg_name, struct scope* sc) {
+		std::unique_ptr<struct pattern> pat;
+		switch (arg_name.type()) {
+		case T_SYM:
+			pat = std::make_unique<struct pattern>(PAT_VAR);
+			pat->slot = scope_declare(sc, arg_name.symbol());
+			break;
+		case T_CONS:
+			if (is(car(arg_name), sym_o)) { /* (o ARG [DEFAULT]) */
+				if (no(cdr(arg_name)) || car(cdr(arg_name)).type() != T_SYM) {
+					pat = std::make_unique<struct pattern>(PAT_INVALID);
+					break;
+				}
+				pat = std::make_unique<struct pattern>(PAT_OPT);
+				if (!no(cdr(cdr(arg_name))))
+					pat->dflt = analyze(car(cdr(cdr(arg_name))), sc);
+				pat->slot = scope_declare(sc, car(cdr(arg_name)).symbol());
+			}
+			else {
+				pat = std::make_unique<struct pattern>(PAT_CONS);
+				pat->car = analyze_pattern(car(arg_name), sc);
+				pat->cdr = analyze_pattern(cdr(arg_name), sc);
+			}
+			break;
+		case T_NIL:
+			pat = std::make_unique<struct pattern>(PAT_NIL);
+			break;
+		default:
+			pat = std::make_unique<struct pattern>(PAT_INVALID);
+		}
+		return pat;
+	}
+
+	/* analyzes (fn args . body), performing the checks of closure creation */
+	error analyze_lambda(atom args, atom body, struct scope* sc, lambda_ptr* result) {
+		atom p;
+
+		if (!listp(body))
+			return ERROR_SYNTAX;
+
+		/* Check argument names are all symbols or conses */
+		p = args;
+		while (!no(p)) {
+			if (p.type() == T_SYM)
+				break;
+			else if (p.type() != T_CONS || (car(p).type() != T_SYM && car(p).type() != T_CONS))
+				return ERROR_TYPE;
+			p = cdr(p);
+		}
+
+		lambda_ptr fn = lambda_ptr(new struct lambda(args, body));
+		struct scope inner{ sc, {} };
+
+		/* the argument list itself is not a destructuring pattern */
+		std::unique_ptr<struct pattern>* tail = &fn->params;
+		int arity = 0;
+		for (p = args; p.type() == T_CONS; p = cdr(p)) {
+			*tail = std::make_unique<struct pattern>(PAT_CONS);
+			(*tail)->car = analyze_pattern(car(p), &inner);
+			if (car(p).type() != T_SYM) arity = -1;
+			else if (arity >= 0) arity++;
+			tail = &(*tail)->cdr;
+		}
+		if (p.type() == T_SYM) {
+			*tail = std::make_unique<struct pattern>(PAT_VAR);
+			(*tail)->slot = scope_declare(&inner, p.symbol());
+			arity = -1;
+		}
+		else {
+			*tail = std::make_unique<struct pattern>(PAT_NIL);
+		}
+		fn->arity = arity;
+
+		for (p = body; !no(p); p = cdr(p)) {
+			fn->code.push_back(analyze(car(p), &inner));
+		}
+		fn->frame_size = inner.vars.size();
+		*result = fn;
+		return ERROR_OK;
+	}
+
+	/* converts a macro-expanded expression into a tree of nodes */
+	node_ptr analyze(const atom& expr, struct scope* sc)
 	{
+		node_ptr n;
 		error err;
-	start_eval:
 
-		if (expr.type == T_SYM) {
-			err = env_get(env, std::get<sym>(expr.val), result);
-			if (err) err_expr = expr;
-			return err;
+		if (expr.type() == T_SYM) {
+			int depth, index;
+			if (scope_resolve(sc, expr.symbol(), &depth, &index)) {
+				n = std::make_unique<struct node>(N_LREF);
+				n->depth = depth;
+				n->index = index;
+			}
+			else {
+				n = std::make_unique<struct node>(N_GREF);
+				n->cell = global_cell(expr.symbol());
+			}
+			n->value = expr;
+			return n;
 		}
-		else if (expr.type != T_CONS) {
-			*result = expr;
-			return ERROR_OK;
+		else if (expr.type() != T_CONS) {
+			n = std::make_unique<struct node>(N_CONST);
+			n->value = expr;
+			return n;
 		}
 		else if (!listp(expr)) {
-			return ERROR_SYNTAX;
+			return make_error_node(ERROR_SYNTAX);
 		}
-		else {
-			const atom& op = car(expr);
-			atom args = cdr(expr);
 
-			if (op.type == T_SYM) {
-				/* Handle special forms */
-				if (sym_is(op, sym_if)) {
-					while (!no(args)) {
-						if (no(cdr(args))) { /* else */
-							/* tail call optimization of else part */
-							expr = car(args);
-							goto start_eval;
-						}
-						err = eval_expr(car(args), env, result);
-						if (err) {
-							return err;
-						}
-						if (!no(*result)) { /* then */
-							/* tail call optimization of err = eval_expr(car(cdr(args)), env, result); */
-							expr = car(cdr(args));
-							goto start_eval;
-						}
-						args = cdr(cdr(args));
-					}
-					return ERROR_OK;
+		const atom& op = car(expr);
+		atom args = cdr(expr);
+		if (op.type() == T_SYM) {
+			/* Handle special forms */
+			if (sym_is(op, sym_if)) {
+				n = std::make_unique<struct node>(N_IF);
+				for (; !no(args); args = cdr(args)) {
+					n->kids.push_back(analyze(car(args), sc));
 				}
-				else if (sym_is(op, sym_assign)) {
-					atom sym1;
-					if (no(args) || no(cdr(args))) {
-						return ERROR_ARGS;
-					}
-
-					sym1 = car(args);
-					if (sym1.type == T_SYM) {
-						err = eval_expr(car(cdr(args)), env, result);
-						if (err) {
-							return err;
-						}
-						err = env_assign_eq(env, std::get<sym>(sym1.val), *result);
-						return err;
-					}
-					else {
-						return ERROR_TYPE;
-					}
+				return n;
+			}
+			else if (sym_is(op, sym_assign)) {
+				if (no(args) || no(cdr(args))) {
+					return make_error_node(ERROR_ARGS);
 				}
-				else if (sym_is(op, sym_quote)) {
-					if (no(args) || !no(cdr(args))) {
-						return ERROR_ARGS;
-					}
-
-					*result = car(args);
-					return ERROR_OK;
+				atom sym1 = car(args);
+				if (sym1.type() != T_SYM) {
+					return make_error_node(ERROR_TYPE);
 				}
-				else if (sym_is(op, sym_fn)) {
-					if (no(args)) {
-						return ERROR_ARGS;
-					}
-					err = make_closure(env, car(args), cdr(args), result);
-					return err;
+				int depth, index;
+				if (scope_resolve(sc, sym1.symbol(), &depth, &index)) {
+					n = std::make_unique<struct node>(N_LSET);
+					n->depth = depth;
+					n->index = index;
 				}
-				else if (sym_is(op, sym_do)) {
-					/* Evaluate the body */
-					*result = nil;
-					while (!no(args)) {
-						if (no(cdr(args))) {
-							/* tail call */
-							expr = car(args);
-							goto start_eval;
-						}
-						error err = eval_expr(car(args), env, result);
-						if (err) {
-							return err;
-						}
-						args = cdr(args);
-					}
-					return ERROR_OK;
+				else {
+					n = std::make_unique<struct node>(N_GSET);
+					n->cell = global_cell(sym1.symbol());
 				}
-				else if (sym_is(op, sym_mac)) { /* (mac name (arg ...) body) */
-					atom name, macro;
-
-					if (no(args) || no(cdr(args)) || no(cdr(cdr(args)))) {
-						return ERROR_ARGS;
-					}
-
-					name = car(args);
-					if (name.type != T_SYM) {
-						return ERROR_TYPE;
-					}
-
-					err = make_closure(env, car(cdr(args)), cdr(cdr(args)), &macro);
-					if (!err) {
-						macro.type = T_MACRO;
-						*result = name;
-						err = env_assign(env, std::get<sym>(name.val), macro);
-						return err;
-					}
-					else {
-						return err;
-					}
+				n->value = sym1;
+				n->kids.push_back(analyze(car(cdr(args)), sc));
+				return n;
+			}
+			else if (sym_is(op, sym_quote)) {
+				if (no(args) || !no(cdr(args))) {
+					return make_error_node(ERROR_ARGS);
 				}
+				n = std::make_unique<struct node>(N_CONST);
+				n->value = car(args);
+				return n;
 			}
-
-			/* Evaluate operator */
-			atom fn;
-			err = eval_expr(op, env, &fn);
-			if (err) {
-				return err;
+			else if (sym_is(op, sym_fn)) {
+				if (no(args)) {
+					return make_error_node(ERROR_ARGS);
+				}
+				lambda_ptr fn;
+				err = analyze_lambda(car(args), cdr(args), sc, &fn);
+				if (err) {
+					return make_error_node(err);
+				}
+				n = std::make_unique<struct node>(N_FN);
+				n->fn = fn;
+				return n;
+			}
+			else if (sym_is(op, sym_do)) {
+				n = std::make_unique<struct node>(N_DO);
+				for (; !no(args); args = cdr(args)) {
+					n->kids.push_back(analyze(car(args), sc));
+				}
+				return n;
+			}
+			else if (sym_is(op, sym_mac)) { /* (mac name (arg ...) body) */
+				if (no(args) || no(cdr(args)) || no(cdr(cdr(args)))) {
+					return make_error_node(ERROR_ARGS);
+				}
+				atom name = car(args);
+				if (name.type() != T_SYM) {
+					return make_error_node(ERROR_TYPE);
+				}
+				lambda_ptr fn;
+				err = analyze_lambda(car(cdr(args)), cdr(cdr(args)), sc, &fn);
+				if (err) {
+					return make_error_node(err);
+				}
+				n = std::make_unique<struct node>(N_MAC);
+				n->value = name;
+				n->fn = fn;
+				/* the macro is bound in the innermost environment */
+				n->index = sc != nullptr ? scope_declare(sc, name.symbol()) : -1;
+				if (n->index < 0)
+					n->cell = global_cell(name.symbol());
+				return n;
+			}
+		}
+
+		n = std::make_unique<struct node>(N_CALL);
+		n->kids.push_back(analyze(op, sc));
+		if (n->kids[0]->type == N_GREF)
+			n->cache = std::make_unique<struct call_cache>();
+		for (; !no(args); args = cdr(args)) {
+			n->kids.push_back(analyze(car(args), sc));
+		}
+		return n;
+	}
+
+	/* refills the inline cache of a call site after a miss */
+	void call_cache_fill(struct call_cache* ic, const struct cell* c, const atom& fn) {
+		builtin bfn = nullptr;
+		const struct closure* cls = nullptr;
+		const struct lambda* target = nullptr;
+		ic->misses++;
+		call_stats.misses++;
+		if (fn.type() == T_BUILTIN) {
+			bfn = fn.fn();
+		}
+		else if (fn.type() == T_CLOSURE) {
+			cls = &fn.asp<struct closure>();
+			target = cls->fn.get();
+		}
+		else { /* not cacheable */
+			ic->version = 0;
+			return;
+		}
+		if (ic->fn == nullptr && ic->target == nullptr) { /* first operator seen */
+			call_stats.monomorphic++;
+		}
+		else if (!ic->polymorphic && (ic->fn != bfn || ic->target != target)) {
+			ic->polymorphic = true;
+			call_stats.monomorphic--;
+			call_stats.polymorphic++;
+		}
+		ic->version = c->version;
+		ic->fn = bfn;
+		ic->cls = cls;
+		ic->target = target;
+	}
+
+	error eval_node(const struct node* n, env_ptr env, atom* result)
+	{
+		error err;
+		lambda_ptr code; /* keeps the body of a tail-called closure alive */
+	start_eval:
+
+		switch (n->type) {
+		case N_CONST:
+			*result = n->value;
+			return ERROR_OK;
+		case N_LREF: {
+			const struct env* e = env.get();
+			int d;
+			for (d = n->depth; d > 0; d--) e = e->parent.get();
+			*result = e->slots[n->index];
+			return ERROR_OK;
+		}
+		case N_GREF:
+			return global_get(n->cell, result);
+		case N_LSET: {
+			err = eval_node(n->kids[0].get(), env, result);
+			if (err) {
+				return err;
+			}
+			struct env* e = env.get();
+			int d;
+			for (d = n->depth; d > 0; d--) e = e->parent.get();
+			e->slots[n->index] = *result;
+			return ERROR_OK;
+		}
+		case N_GSET:
+			err = eval_node(n->kids[0].get(), env, result);
+			if (err) {
+				return err;
+			}
+			global_set(n->cell, *result);
+			return ERROR_OK;
+		case N_IF: {
+			size_t i, count = n->kids.size();
+			for (i = 0; i < count; i += 2) {
+				if (i + 1 == count) { /* else */
+					/* tail call optimization of else part */
+					n = n->kids[i].get();
+					goto start_eval;
+				}
+				err = eval_node(n->kids[i].get(), env, result);
+				if (err) {
+					return err;
+				}
+				if (!no(*result)) { /* then */
+					n = n->kids[i + 1].get();
+					goto start_eval;
+				}
+			}
+			return ERROR_OK;
+		}
+		case N_DO: {
+			size_t i, count = n->kids.size();
+			*result = nil;
+			for (i = 0; i < count; i++) {
+				if (i + 1 == count) {
+					/* tail call */
+					n = n->kids[i].get();
+					goto start_eval;
+				}
+				err = eval_node(n->kids[i].get(), env, result);
+				if (err) {
+					return err;
+				}
+			}
+			return ERROR_OK;
+		}
+		case N_FN:
+			return make_closure(env, n->fn, result);
+		case N_MAC: {
+			atom macro;
+			make_closure(env, n->fn, &macro);
+			macro.set_type(T_MACRO);
+			*result = n->value;
+			if (n->index >= 0) {
+				env->slots[n->index] = macro;
+				return ERROR_OK;
+			}
+			global_set(n->cell, macro);
+			return ERROR_OK;
+		}
+		case N_CALL: {
+			/* Evaluate operator */
+			atom fn;
+			builtin bfn = nullptr;
+			lambda_ptr callee;
+			env_ptr parent_env;
+			struct call_cache* ic = n->cache.get();
+			if (ic && ic->version != 0 && ic->version == n->kids[0]->cell->version) { /* cache hit */
+				ic->hits++;
+				call_stats.hits++;
+				if (ic->fn) {
+					bfn = ic->fn;
+				}
+				else {
+					/* copied before the arguments are evaluated, as they may reassign the operator */
+					callee = ic->cls->fn;
+					parent_env = ic->cls->parent_env;
+				}
+			}
+			else {
+				err = eval_node(n->kids[0].get(), env, &fn);
+				if (err) {
+					return err;
+				}
+				if (ic) {
+					call_cache_fill(ic, n->kids[0]->cell, fn);
+				}
+				if (fn.type() == T_BUILTIN) {
+					bfn = fn.fn();
+				}
+				else if (fn.type() == T_CLOSURE) {
+					callee = fn.asp<struct closure>().fn;
+					parent_env = fn.asp<struct closure>().parent_env;
+				}
 			}
 
 			/* Evaulate arguments */
 			std::vector<atom> vargs;
-			atom* p = &args;
-			while (!no(*p)) {
+			size_t i, count = n->kids.size();
+			vargs.reserve(count - 1);
+			for (i = 1; i < count; i++) {
 				atom r;
-				err = eval_expr(car(*p), env, &r);
+				err = eval_node(n->kids[i].get(), env, &r);
 				if (err) {
 					return err;
 				}
 				vargs.push_back(r);
-				p = &cdr(*p);
 			}
 
+			if (bfn) {
+				return bfn(vargs, result);
+			}
 			/* tail call optimization of err = apply(fn, args, result); */
-			if (fn.type == T_CLOSURE) {
-				struct closure cls = fn.asp<struct closure>();
-				env = std::make_shared<struct env>(cls.parent_env);
-				atom arg_names = cls.args;
-				atom body = cls.body;
+			if (callee) {
+				gc_poll();
+				code = std::move(callee);
+				env = make_env(parent_env, code->frame_size);
 
 				/* Bind the arguments */
-				env_bind(env, arg_names, vargs);
+				env_bind(env, *code, vargs);
 
 				/* Evaluate the body */
-				while (!no(body)) {
-					if (no(cdr(body))) {
+				*result = nil;
+				count = code->code.size();
+				for (i = 0; i < count; i++) {
+					if (i + 1 == count) {
 						/* tail call */
-						expr = car(body);
+						n = code->code[i].get();
 						goto start_eval;
 					}
 					atom r;
-					error err = eval_expr(car(body), env, &r);
+					err = eval_node(code->code[i].get(), env, &r);
 					if (err) {
 						return err;
 					}
-					body = cdr(body);
 				}
 				return ERROR_OK;
 			}
 			else {
-				err = apply(fn, vargs, result);
+				return apply(fn, vargs, result);
 			}
-			return err;
 		}
+		case N_ERROR:
+			return n->err;
+		}
+		return ERROR_SYNTAX;
+	}
+
+	/* bytecode compiler */
+
+	const int op_length[] = { 2, 3, 2, 3, 2, 1, 2, 2, 2, 5, 2, 2, 1, 2 }; /* words per instruction */
+
+	void emit(struct chunk* ch, intptr_t n) {
+		word w;
+		w.n = n;
+		ch->code.push_back(w);
+	}
+
+	void emit_cell(struct chunk* ch, struct cell* c) {
+		word w;
+		w.cell = c;
+		ch->code.push_back(w);
+	}
+
+	intptr_t add_const(struct chunk* ch, const atom& a) {
+		ch->consts.push_back(a);
+		return ch->consts.size() - 1;
+	}
+
+	intptr_t add_fn(struct chunk* ch, const lambda_ptr& fn) {
+		ch->fns.push_back(fn);
+		return ch->fns.size() - 1;
+	}
+
+	/* emits code leaving the value of n on the stack, or returning it in tail position */
+	void compile_node(const struct node* n, struct chunk* ch, bool tail) {
+		size_t i, count = n->kids.size();
+		switch (n->type) {
+		case N_CONST:
+			emit(ch, OP_CONST);
+			emit(ch, add_const(ch, n->value));
+			break;
+		case N_LREF:
+			emit(ch, OP_LREF);
+			emit(ch, n->depth);
+			emit(ch, n->index);
+			break;
+		case N_GREF:
+			emit(ch, OP_GREF);
+			emit_cell(ch, n->cell);
+			break;
+		case N_LSET:
+			compile_node(n->kids[0].get(), ch, false);
+			emit(ch, OP_LSET);
+			emit(ch, n->depth);
+			emit(ch, n->index);
+			break;
+		case N_GSET:
+			compile_node(n->kids[0].get(), ch, false);
+			emit(ch, OP_GSET);
+			emit_cell(ch, n->cell);
+			break;
+		case N_IF: {
+			std::vector<size_t> exits;
+			for (i = 0; i + 1 < count; i += 2) {
+				compile_node(n->kids[i].get(), ch, false);
+				emit(ch, OP_JUMP_IF_NIL);
+				size_t next = ch->code.size();
+				emit(ch, 0);
+				compile_node(n->kids[i + 1].get(), ch, tail);
+				if (!tail) {
+					emit(ch, OP_JUMP);
+					exits.push_back(ch->code.size());
+					emit(ch, 0);
+				}
+				ch->code[next].n = ch->code.size();
+			}
+			if (i < count) { /* else */
+				compile_node(n->kids[i].get(), ch, tail);
+			}
+			else {
+				emit(ch, OP_CONST);
+				emit(ch, add_const(ch, nil));
+				if (tail) emit(ch, OP_RETURN);
+			}
+			for (size_t e : exits) {
+				ch->code[e].n = ch->code.size();
+			}
+			return;
+		}
+		case N_DO:
+			if (count == 0) {
+				emit(ch, OP_CONST);
+				emit(ch, add_const(ch, nil));
+				break;
+			}
+			for (i = 0; i + 1 < count; i++) {
+				compile_node(n->kids[i].get(), ch, false);
+				emit(ch, OP_POP);
+			}
+			compile_node(n->kids[i].get(), ch, tail);
+			return;
+		case N_FN:
+			emit(ch, OP_FN);
+			emit(ch, add_fn(ch, n->fn));
+			break;
+		case N_MAC:
+			emit(ch, OP_MAC);
+			emit(ch, add_fn(ch, n->fn));
+			emit(ch, add_const(ch, n->value));
+			emit(ch, n->index);
+			emit_cell(ch, n->cell);
+			break;
+		case N_CALL:
+			for (i = 0; i < count; i++) {
+				compile_node(n->kids[i].get(), ch, false);
+			}
+			emit(ch, tail ? OP_TAIL_CALL : OP_CALL);
+			emit(ch, count - 1);
+			return;
+		case N_ERROR:
+			emit(ch, OP_ERROR);
+			emit(ch, n->err);
+			return;
+		}
+		if (tail) emit(ch, OP_RETURN);
+	}
+
+	void compile(const struct node* n, struct chunk* ch) {
+		compile_node(n, ch, true);
+	}
+
+	struct chunk* lambda_chunk(const struct lambda& fn) {
+		if (!fn.compiled) {
+			struct chunk* ch = new struct chunk;
+			size_t i, count = fn.code.size();
+			if (count == 0) {
+				emit(ch, OP_CONST);
+				emit(ch, add_const(ch, nil));
+				emit(ch, OP_RETURN);
+			}
+			for (i = 0; i < count; i++) {
+				compile_node(fn.code[i].get(), ch, i + 1 == count);
+				if (i + 1 < count) emit(ch, OP_POP);
+			}
+			fn.compiled.reset(ch);
+		}
+		return fn.compiled.get();
+	}
+
+	/* replaces the opcodes of ch with the addresses of their handlers */
+	void thread_chunk(struct chunk* ch, const void* const* labels) {
+		size_t pc = 0;
+		while (pc < ch->code.size()) {
+			intptr_t op = ch->code[pc].n;
+			ch->code[pc].label = labels[op];
+			pc += op_length[op];
+		}
+		ch->threaded = true;
+	}
+
+	/* bytecode interpreter */
+
+	struct vm_frame {
+		struct chunk* ch;
+		const word* pc;
+		env_ptr env;
+		lambda_ptr fn; /* keeps the code of ch alive */
+	};
+
+#if defined(__GNUC__)
+#define VM_THREADED /* direct-threaded dispatch with computed goto */
+#endif
+
+#ifdef VM_THREADED
+#define VM_TARGET(op) L_##op:
+#define VM_NEXT() goto *(pc++)->label
+#define VM_ENTER(c) do { if (!(c)->threaded) thread_chunk((c), labels); pc = (c)->code.data(); } while (0)
+#else
+#define VM_TARGET(op) case op:
+#define VM_NEXT() break
+#define VM_ENTER(c) pc = (c)->code.data()
+#endif
+
+	error vm_run(struct chunk* ch, env_ptr env, atom* result)
+	{
+#ifdef VM_THREADED
+		static const void* const labels[] = {
+			&&L_OP_CONST, &&L_OP_LREF, &&L_OP_GREF, &&L_OP_LSET, &&L_OP_GSET, &&L_OP_POP, &&L_OP_JUMP,
+			&&L_OP_JUMP_IF_NIL, &&L_OP_FN, &&L_OP_MAC, &&L_OP_CALL, &&L_OP_TAIL_CALL, &&L_OP_RETURN, &&L_OP_ERROR };
+#endif
+		std::vector<atom> stack;
+		std::vector<struct vm_frame> frames;
+		lambda_ptr cur_fn;
+		const word* pc;
+		error err;
+		atom a;
+		intptr_t n;
+		bool tail;
+
+		VM_ENTER(ch);
+#ifdef VM_THREADED
+		VM_NEXT();
+#else
+		for (;;) switch ((pc++)->n) {
+#endif
+		VM_TARGET(OP_CONST)
+			stack.push_back(ch->consts[(pc++)->n]);
+			VM_NEXT();
+		VM_TARGET(OP_LREF) {
+			const struct env* e = env.get();
+			for (n = pc[0].n; n > 0; n--) e = e->parent.get();
+			stack.push_back(e->slots[pc[1].n]);
+			pc += 2;
+			VM_NEXT();
+		}
+		VM_TARGET(OP_GREF) {
+			struct cell* c = (pc++)->cell;
+			if (!c->bound) {
+				err = global_get(c, &a);
+				if (err) {
+					return err;
+				}
+			}
+			stack.push_back(c->value);
+			VM_NEXT();
+		}
+		VM_TARGET(OP_LSET) {
+			struct env* e = env.get();
+			for (n = pc[0].n; n > 0; n--) e = e->parent.get();
+			e->slots[pc[1].n] = stack.back();
+			pc += 2;
+			VM_NEXT();
+		}
+		VM_TARGET(OP_GSET)
+			global_set((pc++)->cell, stack.back());
+			VM_NEXT();
+		VM_TARGET(OP_POP)
+			stack.pop_back();
+			VM_NEXT();
+		VM_TARGET(OP_JUMP)
+			pc = ch->code.data() + pc->n;
+			VM_NEXT();
+		VM_TARGET(OP_JUMP_IF_NIL)
+			if (no(stack.back()))
+				pc = ch->code.data() + pc->n;
+			else
+				pc++;
+			stack.pop_back();
+			VM_NEXT();
+		VM_TARGET(OP_FN)
+			make_closure(env, ch->fns[(pc++)->n], &a);
+			stack.push_back(a);
+			VM_NEXT();
+		VM_TARGET(OP_MAC) {
+			make_closure(env, ch->fns[pc[0].n], &a);
+			a.set_type(T_MACRO);
+			const atom& name = ch->consts[pc[1].n];
+			if (pc[2].n >= 0)
+				env->slots[pc[2].n] = a;
+			else
+				global_set(pc[3].cell, a);
+			pc += 4;
+			stack.push_back(name);
+			VM_NEXT();
+		}
+		VM_TARGET(OP_CALL)
+			tail = false;
+			goto call;
+		VM_TARGET(OP_TAIL_CALL)
+			tail = true;
+		call:
+			n = (pc++)->n;
+			/* A computed goto out of a scope skips its destructors, so the
+			   locals of a call end before the next instruction. */
+			if (stack[stack.size() - n - 1].type() == T_CLOSURE) {
+				gc_poll();
+				{
+					atom* args = stack.data() + stack.size() - n;
+					atom fn = args[-1];
+					lambda_ptr code = fn.asp<struct closure>().fn;
+					env_ptr env1 = make_env(fn.asp<struct closure>().parent_env, code->frame_size);
+
+					/* Bind the arguments */
+					env_bind(env1, *code, args, n);
+					stack.resize(stack.size() - n - 1);
+
+					if (!tail) {
+						frames.push_back({ ch, pc, env, cur_fn });
+					}
+					env = std::move(env1);
+					cur_fn = std::move(code);
+				}
+				ch = lambda_chunk(*cur_fn);
+				VM_ENTER(ch);
+				VM_NEXT();
+			}
+			{
+				atom* args = stack.data() + stack.size() - n;
+				atom fn = args[-1];
+				std::vector<atom> vargs(args, args + n);
+				stack.resize(stack.size() - n - 1);
+				if (fn.type() == T_BUILTIN)
+					err = fn.fn()(vargs, &a);
+				else
+					err = apply(fn, vargs, &a);
+			}
+			if (err) {
+				return err;
+			}
+			stack.push_back(a);
+			if (!tail) {
+				VM_NEXT();
+			}
+			/* fall through to return the result of the tail call */
+		VM_TARGET(OP_RETURN)
+			a = stack.back();
+			stack.pop_back();
+			if (frames.empty()) {
+				*result = a;
+				return ERROR_OK;
+			}
+			{
+				struct vm_frame& f = frames.back();
+				ch = f.ch;
+				pc = f.pc;
+				env = std::move(f.env);
+				cur_fn = std::move(f.fn);
+				frames.pop_back();
+			}
+			stack.push_back(a);
+			VM_NEXT();
+		VM_TARGET(OP_ERROR)
+			return (error)pc->n;
+#ifndef VM_THREADED
+		}
+#endif
+	}
+
+	/* applies a closure with the VM */
+	error vm_apply(const atom& fn, const std::vector<atom>& vargs, atom* result)
+	{
+		const struct closure& cls = fn.asp<struct closure>();
+		lambda_ptr code = cls.fn;
+		env_ptr env = make_env(cls.parent_env, code->frame_size);
+
+		/* Bind the arguments */
+		env_bind(env, *code, vargs);
+
+		return vm_run(lambda_chunk(*code), env, result);
+	}
+
+	/* evaluates an expression at the top level */
+	error eval_expr(atom expr, env_ptr env, atom* result)
+	{
+		node_ptr n = analyze(expr, nullptr);
+		if (use_vm) {
+			struct chunk ch;
+			compile(n.get(), &ch);
+			return vm_run(&ch, env, result);
+		}
+		return eval_node(n.get(), env, result);
 	}
 
 	void bind_global(const std::string& name, const atom &a) {
-		env_assign(global_env, std::get<sym>(make_sym(name).val), a);
+		global_set(global_cell(make_sym(name).symbol()), a);
 	}
 
-	void arc_init() {
+	/* sets up the state that is not part of the global environment */
+	void init_runtime() {
 #ifdef READLINE
 		rl_bind_key('\t', rl_insert); /* prevent tab completion */
 #endif
 		srand((unsigned int)time(0));
+		global_env->buffered = true; /* it has no slots, so it is in no cycle */
 
 		/* Set up the initial environment */
 		sym_t = make_sym("t");
@@ -2309,71 +5500,864 @@ A symbol can be coerced to a string.
 		sym_int = make_sym("int");
 		sym_char = make_sym("char");
 		sym_do = make_sym("do");
-		
-		env_assign(global_env, std::get<sym>(sym_t.val), sym_t);
+		sym_vector = make_sym("vector");
+		sym_f64array = make_sym("f64array");
+		sym_eq = make_sym("eq");
+		sym_sorted_table = make_sym("sorted-table");
+		sym_imap = make_sym("imap");
+		sym_strbuf = make_sym("strbuf");
+	}
+
+	/* startup image */
+
+	const char image_magic[8] = { 'A', 'R', 'C', 'I', 'M', 'G', '5', '\0' };
+	const uint32_t image_none = 0xFFFFFFFF; /* id of a missing env */
+
+	/* kinds of shared objects in an image */
+	enum image_kind {
+		K_CONS, K_STRING, K_TABLE, K_CLOSURE, K_ENV, K_LAMBDA, K_VECTOR, K_F64ARRAY, K_SORTED_TABLE, K_IMAP, K_STRBUF
+	};
+
+	/* Shared objects are numbered in the order they are first written. The first
+	   occurrence writes the id followed by the contents; later ones write only the id. */
+	struct image_writer {
+		std::string out;
+		std::unordered_map<const void*, uint32_t> ids;
+		atom bad; /* value that cannot be saved */
+		bool failed = false;
+		/* when grouping cells into units */
+		uint32_t cell = 0; /* cell being written */
+		std::vector<uint32_t> owner; /* first cell that reached each object, by id */
+		std::vector<uint32_t> group; /* union-find forest of cells that share objects */
+	};
+
+	uint32_t img_group_root(struct image_writer* w, uint32_t c) {
+		while (w->group[c] != c) {
+			w->group[c] = w->group[w->group[c]];
+			c = w->group[c];
+		}
+		return c;
+	}
+
+	void img_put(struct image_writer* w, const void* p, size_t size) {
+		w->out.append((const char*)p, size);
+	}
+
+	void img_put_u8(struct image_writer* w, uint8_t x) {
+		img_put(w, &x, sizeof(x));
+	}
+
+	void img_put_u32(struct image_writer* w, uint32_t x) {
+		img_put(w, &x, sizeof(x));
+	}
+
+	void img_put_i32(struct image_writer* w, int32_t x) {
+		img_put(w, &x, sizeof(x));
+	}
+
+	void img_put_str(struct image_writer* w, const std::string& x) {
+		img_put_u32(w, x.size());
+		w->out += x;
+	}
+
+	/* writes the id of p; returns true if p is new and its contents must follow */
+	bool img_put_id(struct image_writer* w, const void* p) {
+		auto found = w->ids.find(p);
+		if (found != w->ids.end()) {
+			if (!w->owner.empty() && w->owner[found->second] != image_none) { /* shared with another cell */
+				w->group[img_group_root(w, w->cell)] = img_group_root(w, w->owner[found->second]);
+			}
+			img_put_u32(w, found->second);
+			return false;
+		}
+		uint32_t id = w->ids.size();
+		w->ids[p] = id;
+		if (!w->owner.empty()) w->owner.push_back(w->cell);
+		img_put_u32(w, id);
+		return true;
+	}
+
+	void img_write_atom(struct image_writer* w, atom a);
+	void img_write_lambda(struct image_writer* w, const lambda_ptr& fn);
+
+	void img_write_env(struct image_writer* w, const env_ptr& e) {
+		if (!e) {
+			img_put_u32(w, image_none);
+			return;
+		}
+		if (!img_put_id(w, e.get())) return;
+		img_write_env(w, e->parent);
+		img_put_u32(w, e->slots.size());
+		for (auto& a : e->slots) {
+			img_write_atom(w, a);
+		}
+	}
+
+	void img_write_node(struct image_writer* w, const struct node* n) {
+		if (!n) {
+			img_put_u8(w, 0xFF);
+			return;
+		}
+		img_put_u8(w, n->type);
+		img_write_atom(w, n->value);
+		img_put_i32(w, n->depth);
+		img_put_i32(w, n->index);
+		img_put_i32(w, n->cell ? n->cell->name.symbol() : -1);
+		img_put_u8(w, n->err);
+		img_put_u32(w, n->kids.size());
+		for (auto& k : n->kids) {
+			img_write_node(w, k.get());
+		}
+		img_put_u8(w, n->fn != nullptr);
+		if (n->fn) img_write_lambda(w, n->fn);
+	}
+
+	void img_write_pattern(struct image_writer* w, const struct pattern* pat) {
+		if (!pat) {
+			img_put_u8(w, 0xFF);
+			return;
+		}
+		img_put_u8(w, pat->type);
+		img_put_i32(w, pat->slot);
+		img_write_node(w, pat->dflt.get());
+		img_write_pattern(w, pat->car.get());
+		img_write_pattern(w, pat->cdr.get());
+	}
+
+	void img_write_lambda(struct image_writer* w, const lambda_ptr& fn) {
+		if (!img_put_id(w, fn.get())) return;
+		img_write_atom(w, fn->args);
+		img_write_atom(w, fn->body);
+		img_put_i32(w, fn->arity);
+		img_put_u32(w, fn->frame_size);
+		img_write_pattern(w, fn->params.get());
+		img_put_u32(w, fn->code.size());
+		for (auto& n : fn->code) {
+			img_write_node(w, n.get());
+		}
+	}
+
+	void img_write_atom(struct image_writer* w, atom a) {
+		for (;;) { /* loops over the cdrs of a list */
+			img_put_u8(w, a.type());
+			switch (a.type()) {
+			case T_NIL:
+				return;
+			case T_CONS:
+				if (!img_put_id(w, a.obj())) return;
+				img_write_atom(w, car(a));
+				a = cdr(a);
+				continue;
+			case T_SYM:
+				img_put_i32(w, a.symbol());
+				return;
+			case T_NUM: {
+				img_put_u8(w, a.is_int());
+				if (a.is_int()) {
+					int64_t i = a.integer();
+					img_put(w, &i, sizeof(i));
+					return;
+				}
+				double x = a.number();
+				img_put(w, &x, sizeof(x));
+				return;
+			}
+			case T_BUILTIN: {
+				uint32_t i;
+				for (i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+					if (builtins[i].fn == a.fn()) {
+						img_put_u32(w, i);
+						return;
+					}
+				}
+				break;
+			}
+			case T_CLOSURE:
+			case T_MACRO: {
+				if (!img_put_id(w, a.obj())) return;
+				img_write_lambda(w, a.asp<struct closure>().fn);
+				img_write_env(w, a.asp<struct closure>().parent_env);
+				return;
+			}
+			case T_STRING:
+				if (img_put_id(w, &a.asp<std::string>()))
+					img_put_str(w, a.asp<std::string>());
+				return;
+			case T_INPUT:
+			case T_OUTPUT: {
+				FILE* fp = a.file();
+				if (fp == stdin || fp == stdout || fp == stderr) {
+					img_put_u8(w, fp == stdin ? 0 : fp == stdout ? 1 : 2);
+					return;
+				}
+				break;
+			}
+			case T_TABLE: {
+				auto& tbl = a.asp<table>();
+				if (!img_put_id(w, &tbl)) return;
+				img_put_u8(w, tbl.eq);
+				img_put_u32(w, tbl.size());
+				for (auto& p : tbl) {
+					img_write_atom(w, p.first);
+					img_write_atom(w, p.second);
+				}
+				return;
+			}
+			case T_VECTOR: {
+				auto& v = a.asp<std::vector<atom>>();
+				if (!img_put_id(w, &v)) return;
+				img_put_u32(w, v.size());
+				for (auto& x : v) {
+					img_write_atom(w, x);
+				}
+				return;
+			}
+			case T_STRBUF:
+				if (img_put_id(w, &a.asp<rope>()))
+					img_put_str(w, a.asp<rope>().str());
+				return;
+			case T_IMAP: {
+				auto& h = a.asp<hamt>();
+				if (!img_put_id(w, &h)) return;
+				img_put_u8(w, ((struct imap_object*)a.obj())->transient);
+				img_put_u32(w, h.size());
+				h.each([&](const atom& k, const atom& v) {
+					img_write_atom(w, k);
+					img_write_atom(w, v);
+				});
+				return;
+			}
+			case T_SORTED_TABLE: {
+				auto& st = a.asp<sorted_table>();
+				if (!img_put_id(w, &st)) return;
+				img_put_u32(w, st.size());
+				st.each([&](const atom& k, const atom& v) {
+					img_write_atom(w, k);
+					img_write_atom(w, v);
+				});
+				return;
+			}
+			case T_F64ARRAY: {
+				auto& v = a.asp<std::vector<double>>();
+				if (!img_put_id(w, &v)) return;
+				img_put_u32(w, v.size());
+				img_put(w, v.data(), v.size() * sizeof(double));
+				return;
+			}
+			case T_CHAR:
+				img_put_u32(w, a.character());
+				return;
+			default:
+				break;
+			}
+			/* pipes, open files and continuations */
+			if (!w->failed) w->bad = a;
+			w->failed = true;
+			return;
+		}
+	}
+
+	/* Encodes the global environment. Cells whose values share objects are
+	   grouped into a unit, and each unit is decoded when one of its cells is first used. */
+	error image_of_globals(std::string* result) {
+		uint32_t i, count = global_cells.size();
+		for (i = 0; i < count; i++) { /* units not used yet */
+			if (global_cells[i].unit) {
+				error err = image_load_unit(global_cells[i].unit - 1);
+				if (err) return err;
+			}
+		}
+
+		/* find the cells that share objects */
+		struct image_writer w;
+		w.ids[global_env.get()] = 0;
+		w.owner.push_back(image_none);
+		for (i = 0; i < count; i++) {
+			w.group.push_back(i);
+		}
+		for (i = 0; i < count; i++) {
+			if (!global_cells[i].bound) continue;
+			w.cell = i;
+			img_write_atom(&w, global_cells[i].value);
+		}
+		if (w.failed) {
+			err_expr = w.bad;
+			return ERROR_TYPE;
+		}
+		std::vector<uint32_t> unit_of_group(count, image_none);
+		std::vector<std::vector<uint32_t>> units;
+		for (i = 0; i < count; i++) {
+			if (!global_cells[i].bound) continue;
+			uint32_t g = img_group_root(&w, i);
+			if (unit_of_group[g] == image_none) {
+				unit_of_group[g] = units.size();
+				units.emplace_back();
+			}
+			units[unit_of_group[g]].push_back(i);
+		}
+
+		struct image_writer out;
+		img_put(&out, image_magic, sizeof(image_magic));
+		img_put_u32(&out, str_of_sym.size());
+		for (i = 0; i < str_of_sym.size(); i++) {
+			img_put_str(&out, std::string(sym_name(i)));
+		}
+		img_put_u32(&out, count);
+		for (i = 0; i < count; i++) {
+			img_put_u32(&out, global_cells[i].bound ? unit_of_group[img_group_root(&w, i)] + 1 : 0);
+		}
+		img_put_u32(&out, units.size());
+		for (auto& cells : units) {
+			struct image_writer u;
+			u.ids[global_env.get()] = 0;
+			img_put_u32(&u, cells.size());
+			for (uint32_t c : cells) {
+				img_put_u32(&u, c);
+				img_write_atom(&u, global_cells[c].value);
+			}
+			img_put_u32(&out, u.out.size());
+			out.out += u.out;
+		}
+		*result = std::move(out.out);
+		return ERROR_OK;
+	}
+
+	/* saves the global environment to an image file */
+	error arc_dump_image(const char* path) {
+		std::string image;
+		error err = image_of_globals(&image);
+		if (err) return err;
+
+		FILE* fp = fopen(path, "wb");
+		if (!fp) return ERROR_FILE;
+		size_t written = fwrite(image.data(), 1, image.size(), fp);
+		if (fclose(fp) != 0 || written != image.size()) return ERROR_FILE;
+		return ERROR_OK;
+	}
+
+	/* saves the global environment as C++ source defining prelude_image, which the build links into arc++ */
+	error arc_dump_prelude(const char* path) {
+		std::string image;
+		error err = image_of_globals(&image);
+		if (err) return err;
+
+		FILE* fp = fopen(path, "w");
+		if (!fp) return ERROR_FILE;
+		fprintf(fp, "/* generated from library.h by arc++-boot --dump-prelude. Do not edit. */\n");
+		fprintf(fp, "#include <stddef.h>\n\nnamespace arc {\n");
+		fprintf(fp, "\textern const unsigned char prelude_image[] = {");
+		size_t i;
+		for (i = 0; i < image.size(); i++) {
+			fprintf(fp, i % 20 == 0 ? "\n\t\t%u," : "%u,", (unsigned char)image[i]);
+		}
+		fprintf(fp, "\n\t};\n\textern const size_t prelude_image_size = sizeof(prelude_image);\n}\n");
+		if (fclose(fp) != 0) return ERROR_FILE;
+		return ERROR_OK;
+	}
+
+	struct image_reader {
+		const char* p;
+		const char* end;
+		bool bad = false; /* truncated or malformed */
+		std::vector<env_ptr> envs; /* envs by id */
+		std::vector<lambda_ptr> lambdas; /* lambdas by id */
+		std::vector<atom> atoms; /* other shared objects by id */
+		std::vector<enum image_kind> kinds;
+	};
+
+	void img_get(struct image_reader* r, void* dst, size_t size) {
+		if ((size_t)(r->end - r->p) < size) {
+			r->bad = true;
+			memset(dst, 0, size);
+			return;
+		}
+		memcpy(dst, r->p, size);
+		r->p += size;
+	}
+
+	uint8_t img_get_u8(struct image_reader* r) {
+		uint8_t x;
+		img_get(r, &x, sizeof(x));
+		return x;
+	}
+
+	uint32_t img_get_u32(struct image_reader* r) {
+		uint32_t x;
+		img_get(r, &x, sizeof(x));
+		return x;
+	}
+
+	int32_t img_get_i32(struct image_reader* r) {
+		int32_t x;
+		img_get(r, &x, sizeof(x));
+		return x;
+	}
+
+	std::string img_get_str(struct image_reader* r) {
+		uint32_t size = img_get_u32(r);
+		if ((size_t)(r->end - r->p) < size) {
+			r->bad = true;
+			return "";
+		}
+		std::string s(r->p, size);
+		r->p += size;
+		return s;
+	}
+
+	sym img_get_sym(struct image_reader* r) {
+		int32_t s = img_get_i32(r);
+		if (s < 0 || (size_t)s >= str_of_sym.size()) {
+			r->bad = true;
+			return 0;
+		}
+		return s;
+	}
+
+	/* reads an id; returns true if the object is new, and reserves its id */
+	bool img_get_id(struct image_reader* r, enum image_kind kind, uint32_t* id) {
+		*id = img_get_u32(r);
+		if (*id == r->kinds.size() && !r->bad) {
+			r->envs.emplace_back();
+			r->lambdas.emplace_back();
+			r->atoms.emplace_back();
+			r->kinds.push_back(kind);
+			return true;
+		}
+		return false;
+	}
+
+	/* returns an object read before, or nullptr */
+	template <typename T>
+	ref<T> img_ref(struct image_reader* r, const std::vector<ref<T>>& objs, enum image_kind kind, uint32_t id) {
+		if (id >= objs.size() || r->kinds[id] != kind || !objs[id]) {
+			r->bad = true;
+			return nullptr;
+		}
+		return objs[id];
+	}
+
+	/* returns an atom pointing to an object read before, or nil */
+	atom img_ref_atom(struct image_reader* r, enum image_kind kind, uint32_t id) {
+		if (id >= r->atoms.size() || r->kinds[id] != kind || no(r->atoms[id])) {
+			r->bad = true;
+			return nil;
+		}
+		return r->atoms[id];
+	}
+
+	void img_read_atom(struct image_reader* r, atom* out);
+	lambda_ptr img_read_lambda(struct image_reader* r);
+
+	env_ptr img_read_env(struct image_reader* r) {
+		uint32_t id;
+		if (!img_get_id(r, K_ENV, &id)) {
+			if (id == image_none) return nullptr;
+			return img_ref(r, r->envs, K_ENV, id);
+		}
+		env_ptr e = make_env(nullptr, 0);
+		r->envs[id] = e;
+		e->parent = img_read_env(r);
+		uint32_t i, count = img_get_u32(r);
+		for (i = 0; i < count && !r->bad; i++) {
+			atom a;
+			img_read_atom(r, &a);
+			e->slots.push_back(a);
+		}
+		return e;
+	}
+
+	node_ptr img_read_node(struct image_reader* r) {
+		uint8_t type = img_get_u8(r);
+		if (type == 0xFF || r->bad) return nullptr;
+		if (type > N_ERROR) {
+			r->bad = true;
+			return nullptr;
+		}
+		node_ptr n = std::make_unique<struct node>((enum node_type)type);
+		img_read_atom(r, &n->value);
+		n->depth = img_get_i32(r);
+		n->index = img_get_i32(r);
+		int32_t s = img_get_i32(r);
+		if (s >= 0) {
+			if ((size_t)s < str_of_sym.size())
+				n->cell = global_cell(s);
+			else
+				r->bad = true;
+		}
+		n->err = (error)img_get_u8(r);
+		uint32_t i, count = img_get_u32(r);
+		for (i = 0; i < count && !r->bad; i++) {
+			n->kids.push_back(img_read_node(r));
+		}
+		if (img_get_u8(r)) n->fn = img_read_lambda(r);
+		if (n->type == N_CALL && !n->kids.empty() && n->kids[0] && n->kids[0]->type == N_GREF)
+			n->cache = std::make_unique<struct call_cache>();
+		return n;
+	}
+
+	std::unique_ptr<struct pattern> img_read_pattern(struct image_reader* r) {
+		uint8_t type = img_get_u8(r);
+		if (type == 0xFF || r->bad) return nullptr;
+		if (type > PAT_INVALID) {
+			r->bad = true;
+			return nullptr;
+		}
+		std::unique_ptr<struct pattern> pat = std::make_unique<struct pattern>((enum pattern_type)type);
+		pat->slot = img_get_i32(r);
+		pat->dflt = img_read_node(r);
+		pat->car = img_read_pattern(r);
+		pat->cdr = img_read_pattern(r);
+		return pat;
+	}
+
+	lambda_ptr img_read_lambda(struct image_reader* r) {
+		uint32_t id;
+		if (!img_get_id(r, K_LAMBDA, &id)) return img_ref(r, r->lambdas, K_LAMBDA, id);
+		atom args, body;
+		img_read_atom(r, &args);
+		img_read_atom(r, &body);
+		lambda_ptr fn = lambda_ptr(new struct lambda(args, body));
+		r->lambdas[id] = fn;
+		fn->arity = img_get_i32(r);
+		fn->frame_size = img_get_u32(r);
+		fn->params = img_read_pattern(r);
+		uint32_t i, count = img_get_u32(r);
+		for (i = 0; i < count && !r->bad; i++) {
+			fn->code.push_back(img_read_node(r));
+		}
+		return fn;
+	}
+
+	void img_read_atom(struct image_reader* r, atom* out) {
+		for (;;) { /* loops over the cdrs of a list */
+			uint8_t type = img_get_u8(r);
+			uint32_t id;
+			*out = nil;
+			if (r->bad) return;
+			switch (type) {
+			case T_NIL:
+				return;
+			case T_CONS:
+				if (img_get_id(r, K_CONS, &id)) {
+					*out = make_cons(nil, nil);
+					r->atoms[id] = *out;
+					img_read_atom(r, &car(*out));
+					out = &cdr(*out);
+					continue;
+				}
+				*out = img_ref_atom(r, K_CONS, id);
+				return;
+			case T_SYM:
+				*out = atom(T_SYM, (uint64_t)img_get_sym(r));
+				return;
+			case T_NUM: {
+				if (img_get_u8(r)) {
+					int64_t i;
+					img_get(r, &i, sizeof(i));
+					*out = make_int(i);
+					return;
+				}
+				double x;
+				img_get(r, &x, sizeof(x));
+				*out = make_number(x);
+				return;
+			}
+			case T_BUILTIN: {
+				uint32_t i = img_get_u32(r);
+				if (i >= sizeof(builtins) / sizeof(builtins[0])) break;
+				*out = make_builtin(builtins[i].fn);
+				return;
+			}
+			case T_CLOSURE:
+			case T_MACRO:
+				if (img_get_id(r, K_CLOSURE, &id)) {
+					lambda_ptr fn = img_read_lambda(r);
+					if (!fn) break;
+					make_closure(nullptr, fn, out);
+					r->atoms[id] = *out;
+					out->asp<struct closure>().parent_env = img_read_env(r);
+				}
+				else {
+					*out = img_ref_atom(r, K_CLOSURE, id);
+					if (no(*out)) return;
+				}
+				out->set_type((enum type)type);
+				return;
+			case T_STRING:
+				if (img_get_id(r, K_STRING, &id)) {
+					*out = make_string(img_get_str(r));
+					r->atoms[id] = *out;
+				}
+				else {
+					*out = img_ref_atom(r, K_STRING, id);
+				}
+				return;
+			case T_INPUT:
+			case T_OUTPUT:
+				switch (img_get_u8(r)) {
+				case 0: *out = make_input(stdin); return;
+				case 1: *out = make_output(stdout); return;
+				case 2: *out = make_output(stderr); return;
+				}
+				break;
+			case T_TABLE:
+				if (img_get_id(r, K_TABLE, &id)) {
+					*out = make_table(img_get_u8(r) != 0);
+					r->atoms[id] = *out;
+					auto& tbl = out->asp<table>();
+					uint32_t i, count = img_get_u32(r);
+					for (i = 0; i < count && !r->bad; i++) {
+						atom k, v;
+						img_read_atom(r, &k);
+						img_read_atom(r, &v);
+						tbl[k] = v;
+					}
+				}
+				else {
+					*out = img_ref_atom(r, K_TABLE, id);
+				}
+				return;
+			case T_VECTOR:
+				if (img_get_id(r, K_VECTOR, &id)) {
+					uint32_t i, count = img_get_u32(r);
+					if ((size_t)(r->end - r->p) < count) { /* each element takes a byte at least */
+						r->bad = true;
+						return;
+					}
+					*out = make_vector(std::vector<atom>(count));
+					r->atoms[id] = *out;
+					auto& v = out->asp<std::vector<atom>>();
+					for (i = 0; i < count && !r->bad; i++) {
+						img_read_atom(r, &v[i]);
+					}
+				}
+				else {
+					*out = img_ref_atom(r, K_VECTOR, id);
+				}
+				return;
+			case T_STRBUF:
+				if (img_get_id(r, K_STRBUF, &id)) {
+					*out = make_strbuf();
+					out->asp<rope>().append(img_get_str(r));
+					r->atoms[id] = *out;
+				}
+				else {
+					*out = img_ref_atom(r, K_STRBUF, id);
+				}
+				return;
+			case T_IMAP:
+				if (img_get_id(r, K_IMAP, &id)) {
+					bool transient = img_get_u8(r) != 0;
+					*out = make_imap(hamt(), transient);
+					r->atoms[id] = *out;
+					auto& h = out->asp<hamt>();
+					uint32_t i, count = img_get_u32(r);
+					for (i = 0; i < count && !r->bad; i++) {
+						atom k, v;
+						img_read_atom(r, &k);
+						img_read_atom(r, &v);
+						h.set(k, v);
+					}
+				}
+				else {
+					*out = img_ref_atom(r, K_IMAP, id);
+				}
+				return;
+			case T_SORTED_TABLE:
+				if (img_get_id(r, K_SORTED_TABLE, &id)) {
+					*out = make_sorted_table();
+					r->atoms[id] = *out;
+					auto& st = out->asp<sorted_table>();
+					uint32_t i, count = img_get_u32(r);
+					for (i = 0; i < count && !r->bad; i++) {
+						atom k, v;
+						img_read_atom(r, &k);
+						img_read_atom(r, &v);
+						if (!sorted_key(k)) r->bad = true;
+						else st[k] = v;
+					}
+				}
+				else {
+					*out = img_ref_atom(r, K_SORTED_TABLE, id);
+				}
+				return;
+			case T_F64ARRAY:
+				if (img_get_id(r, K_F64ARRAY, &id)) {
+					uint32_t count = img_get_u32(r);
+					if ((size_t)(r->end - r->p) / sizeof(double) < count) {
+						r->bad = true;
+						return;
+					}
+					std::vector<double> v(count);
+					img_get(r, v.data(), count * sizeof(double));
+					*out = make_f64array(std::move(v));
+					r->atoms[id] = *out;
+				}
+				else {
+					*out = img_ref_atom(r, K_F64ARRAY, id);
+				}
+				return;
+			case T_CHAR:
+				*out = make_char(img_get_u32(r));
+				return;
+			}
+			r->bad = true;
+			return;
+		}
+	}
+
+	/* maps a whole file into memory; returns nullptr on failure */
+	const char* map_file(const char* path, size_t* size) {
+#ifdef _WIN32
+		FILE* fp = fopen(path, "rb");
+		if (!fp) return nullptr;
+		fseek(fp, 0, SEEK_END);
+		long len = ftell(fp);
+		fseek(fp, 0, SEEK_SET);
+		char* buf = len < 0 ? nullptr : (char*)malloc(len + 1);
+		if (buf && fread(buf, 1, len, fp) != (size_t)len) {
+			free(buf);
+			buf = nullptr;
+		}
+		fclose(fp);
+		*size = len;
+		return buf;
+#else
+		int fd = open(path, O_RDONLY);
+		if (fd < 0) return nullptr;
+		struct stat st;
+		void* p = MAP_FAILED;
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		}
+		close(fd);
+		if (p == MAP_FAILED) return nullptr;
+		*size = st.st_size;
+		return (const char*)p;
+#endif
+	}
+
+	void unmap_file(const char* data, size_t size) {
+#ifdef _WIN32
+		free((void*)data);
+#else
+		munmap((void*)data, size);
+#endif
+	}
+
+	/* encoded units of loaded images that are not decoded yet, by unit index */
+	std::vector<std::pair<const char*, size_t>> image_units;
+
+	/* binds the cells of a unit that have not been assigned since the image was loaded;
+	   a unit that does not decode stays unloaded and fails again on its next use */
+	error image_load_unit(uint32_t unit) {
+		const char* data = image_units[unit].first;
+		if (!data) return ERROR_OK; /* already loaded */
+		image_units[unit].first = nullptr;
+
+		struct image_reader r;
+		r.p = data;
+		r.end = data + image_units[unit].second;
+		r.envs.push_back(global_env);
+		r.lambdas.emplace_back();
+		r.atoms.emplace_back();
+		r.kinds.push_back(K_ENV);
+		std::vector<std::pair<sym, atom>> values;
+		uint32_t i, count = img_get_u32(&r);
+		for (i = 0; i < count && !r.bad; i++) {
+			sym s = img_get_sym(&r);
+			atom a;
+			img_read_atom(&r, &a);
+			values.emplace_back(s, a);
+		}
+		if (r.bad || r.p != r.end) {
+			image_units[unit].first = data;
+			return ERROR_IMAGE;
+		}
+		for (auto& v : values) {
+			struct cell* c = global_cell(v.first);
+			if (c->unit == unit + 1) global_set(c, v.second);
+		}
+		return ERROR_OK;
+	}
+
+	/* Sets up the global environment from an image in memory, which must stay mapped.
+	   Only the symbols are read now; a unit is decoded when one of its cells is first used. */
+	bool load_image(const char* data, size_t size) {
+		struct image_reader r;
+		r.p = data;
+		r.end = data + size;
+
+		char magic[sizeof(image_magic)];
+		img_get(&r, magic, sizeof(magic));
+		if (memcmp(magic, image_magic, sizeof(magic)) != 0) r.bad = true;
+
+		/* symbols keep their ids, which the rest of the image refers to */
+		uint32_t i, count = img_get_u32(&r);
+		for (i = 0; i < count && !r.bad; i++) {
+			if (make_sym(img_get_str(&r)).symbol() != (sym)i) r.bad = true;
+		}
+		init_runtime();
+
+		std::vector<uint32_t> cell_units;
+		count = img_get_u32(&r);
+		if (count > str_of_sym.size()) r.bad = true;
+		for (i = 0; i < count && !r.bad; i++) {
+			cell_units.push_back(img_get_u32(&r));
+		}
+		size_t base = image_units.size();
+		count = img_get_u32(&r);
+		for (i = 0; i < count && !r.bad; i++) {
+			uint32_t size = img_get_u32(&r);
+			if ((size_t)(r.end - r.p) < size) {
+				r.bad = true;
+				break;
+			}
+			image_units.emplace_back(r.p, size);
+			r.p += size;
+		}
+		for (uint32_t u : cell_units) {
+			if (u > count) r.bad = true;
+		}
+		if (r.bad || r.p != r.end) {
+			image_units.resize(base);
+			return false;
+		}
+		for (i = 0; i < cell_units.size(); i++) {
+			if (cell_units[i]) global_cell(i)->unit = base + cell_units[i];
+		}
+		return true;
+	}
+
+	/* sets up the global environment from an image file instead of the standard library */
+	error arc_init_image(const char* path) {
+		size_t size;
+		const char* data = map_file(path, &size);
+		if (!data || !load_image(data, size)) {
+			if (data) unmap_file(data, size);
+			err_expr = make_string(path);
+			return ERROR_FILE;
+		}
+		return ERROR_OK; /* the file stays mapped for the units used later */
+	}
+
+	void arc_init() {
+#ifdef PRELUDE_IMAGE
+		/* the library was loaded at build time */
+		if (!load_image((const char*)prelude_image, prelude_image_size)) {
+			fputs("Invalid prelude image\n", stderr);
+		}
+#else
+		init_runtime();
+
+		global_set(global_cell(sym_t.symbol()), sym_t);
 		bind_global("nil", nil);
-		bind_global("car", make_builtin(builtin_car));
-		bind_global("cdr", make_builtin(builtin_cdr));
-		bind_global("cons", make_builtin(builtin_cons));
-		bind_global("+", make_builtin(builtin_add));
-		bind_global("-", make_builtin(builtin_subtract));
-		bind_global("*", make_builtin(builtin_multiply));
-		bind_global("/", make_builtin(builtin_divide));
-		bind_global("<", make_builtin(builtin_less));
-		bind_global(">", make_builtin(builtin_greater));
-		bind_global("apply", make_builtin(builtin_apply));
-		bind_global("is", make_builtin(builtin_is));
-		bind_global("scar", make_builtin(builtin_scar));
-		bind_global("scdr", make_builtin(builtin_scdr));
-		bind_global("mod", make_builtin(builtin_mod));
-		bind_global("type", make_builtin(builtin_type));
-		bind_global("string-sref", make_builtin(builtin_string_sref));
-		bind_global("writeb", make_builtin(builtin_writeb));
-		bind_global("expt", make_builtin(builtin_expt));
-		bind_global("log", make_builtin(builtin_log));
-		bind_global("sqrt", make_builtin(builtin_sqrt));
-		bind_global("readline", make_builtin(builtin_readline));
-		bind_global("quit", make_builtin(builtin_quit));
-		bind_global("rand", make_builtin(builtin_rand));
-		bind_global("read", make_builtin(builtin_read));
-		bind_global("macex", make_builtin(builtin_macex));
-		bind_global("string", make_builtin(builtin_string));
-		bind_global("sym", make_builtin(builtin_sym));
-		bind_global("system", make_builtin(builtin_system));
-		bind_global("eval", make_builtin(builtin_eval));
-		bind_global("load", make_builtin(builtin_load));
-		bind_global("int", make_builtin(builtin_int));
-		bind_global("trunc", make_builtin(builtin_trunc));
-		bind_global("sin", make_builtin(builtin_sin));
-		bind_global("cos", make_builtin(builtin_cos));
-		bind_global("tan", make_builtin(builtin_tan));
-		bind_global("bound", make_builtin(builtin_bound));
-		bind_global("infile", make_builtin(builtin_infile));
-		bind_global("outfile", make_builtin(builtin_outfile));
-		bind_global("close", make_builtin(builtin_close));
+		for (auto& b : builtins) {
+			bind_global(b.name, make_builtin(b.fn));
+		}
 		bind_global("stdin", make_input(stdin));
 		bind_global("stdout", make_output(stdout));
 		bind_global("stderr", make_output(stderr));
-		bind_global("disp", make_builtin(builtin_disp));
-		bind_global("readb", make_builtin(builtin_readb));
-		bind_global("sread", make_builtin(builtin_sread));
-		bind_global("write", make_builtin(builtin_write));
-		bind_global("newstring", make_builtin(builtin_newstring));
-		bind_global("table", make_builtin(builtin_table));
-		bind_global("maptable", make_builtin(builtin_maptable));
-		bind_global("table-sref", make_builtin(builtin_table_sref));
-		bind_global("coerce", make_builtin(builtin_coerce));
-		bind_global("flushout", make_builtin(builtin_flushout));
-		bind_global("err", make_builtin(builtin_err));
-		bind_global("len", make_builtin(builtin_len));
-		bind_global("ccc", make_builtin(builtin_ccc));
-		bind_global("mvfile", make_builtin(builtin_mvfile));
-		bind_global("rmfile", make_builtin(builtin_rmfile));
-		bind_global("dir", make_builtin(builtin_dir));
-		bind_global("pipe-from", make_builtin(builtin_pipe_from));
-		bind_global("dir-exists", make_builtin(builtin_dir_exists));
-		bind_global("file-exists", make_builtin(builtin_file_exists));
-		bind_global("ensure-dir", make_builtin(builtin_ensure_dir));
 
 #include "library.h"
 
@@ -2381,6 +6365,7 @@ A symbol can be coerced to a string.
 		if (err) {
 			print_error(err);
 		}
+#endif
 	}
 
 	void print_error(error e) {
@@ -2404,6 +6389,7 @@ A symbol can be coerced to a string.
 			error err;
 
 			atom expr;
+			gc_root expr_root(&expr);
 			err = read_expr(p, &p, &expr);
 			if (err == ERROR_FILE) { /* read more lines */
 				char* line = readline("  ");
@@ -2431,6 +6417,8 @@ A symbol can be coerced to a string.
 						print_expr(result);
 						puts("");
 					}
+					result = nil;
+					gc_safe_point();
 					err = read_expr(p, &p, &expr);
 					if (err != ERROR_OK) {
 						break;
@@ -10,18 +10,36 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <math.h>
 #include <time.h>
+#include <errno.h>
 #include <setjmp.h>
 #include <memory>
 #include <vector>
 #include <unordered_map>
+#include <deque>
 #include <utility>
+#include <string_view>
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <iomanip>
 #include <filesystem>
-#include <variant>
+#include <chrono>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
 
 #ifdef READLINE
 #include <readline/readline.h>
@@ -49,56 +67,680 @@ namespace arc {
 		T_OUTPUT,
 		T_TABLE,
 		T_CHAR,
-		T_CONTINUATION
+		T_CONTINUATION,
+		T_VECTOR,
+		T_F64ARRAY,
+		T_SORTED_TABLE,
+		T_IMAP,
+		T_STRBUF
 	};
 
 	typedef enum {
-		ERROR_OK = 0, ERROR_SYNTAX, ERROR_UNBOUND, ERROR_ARGS, ERROR_TYPE, ERROR_FILE, ERROR_USER
+		ERROR_OK = 0, ERROR_SYNTAX, ERROR_UNBOUND, ERROR_ARGS, ERROR_TYPE, ERROR_FILE, ERROR_USER, ERROR_RANGE, ERROR_IMAGE
 	} error;
 
 	typedef struct atom atom;
 	typedef error(*builtin)(const std::vector<atom> &vargs, atom *result);
-	typedef std::unordered_map<atom, atom> table;
 	typedef int sym;
-	typedef std::unordered_map<sym, atom> env_table;
-	
+
+	/* Free list of fixed-size blocks carved from pages, for the objects allocated
+	   most. The block size is set by the first allocation. Pages are kept for reuse. */
+	struct pool {
+		const char *name;
+		size_t size = 0; /* block size */
+		void *free_list = nullptr;
+		char *next = nullptr, *end = nullptr; /* unused part of the last page */
+		size_t pages = 0, blocks = 0, used = 0; /* blocks carved and blocks in use */
+		static const size_t page_size = 64 * 1024;
+
+		constexpr pool(const char *name) : name(name) {}
+
+		void *alloc(size_t n) {
+			if (size == 0) size = (std::max(n, sizeof(void *)) + 7) & ~(size_t)7;
+			used++;
+			if (free_list) {
+				void *p = free_list;
+				free_list = *(void **)p;
+				return p;
+			}
+			if (next + size > end) {
+				next = (char *)malloc(page_size);
+				if (!next) throw std::bad_alloc();
+				end = next + page_size;
+				pages++;
+			}
+			void *p = next;
+			next += size;
+			blocks++;
+			return p;
+		}
+
+		void free(void *p) {
+			*(void **)p = free_list;
+			free_list = p;
+			used--;
+		}
+	};
+
+	extern struct pool cons_pool, closure_pool, env_pool;
+
+	/* Pointer holding a reference to an env or lambda, which counts them in its
+	   refs field. Like the count of an object, it is not atomic. */
+	template <typename T>
+	struct ref {
+		T *p = nullptr;
+
+		ref() = default;
+		ref(std::nullptr_t) {}
+		explicit ref(T *p) : p(p) { if (p) p->refs++; }
+		ref(const ref &r) : p(r.p) { if (p) p->refs++; }
+		ref(ref &&r) noexcept : p(r.p) { r.p = nullptr; }
+		~ref() { release(); }
+
+		ref &operator =(const ref &r) {
+			T *q = r.p;
+			if (q) q->refs++;
+			release();
+			p = q;
+			return *this;
+		}
+
+		ref &operator =(ref &&r) noexcept {
+			T *q = r.p;
+			r.p = nullptr;
+			release();
+			p = q;
+			return *this;
+		}
+
+		T *get() const { return p; }
+		T *operator ->() const { return p; }
+		T &operator *() const { return *p; }
+		explicit operator bool() const { return p != nullptr; }
+		bool operator ==(const ref &r) const { return p == r.p; }
+		bool operator !=(const ref &r) const { return p != r.p; }
+		void reset() { release(); p = nullptr; }
+		static void destroy(T *p); /* out of line, to keep the copies small */
+
+	private:
+		void release() {
+			if (!p) return;
+			if (--p->refs == 0) destroy(p);
+			else possible_cycle(p);
+		}
+	};
+
+	typedef ref<struct env> env_ptr;
+	typedef ref<struct lambda> lambda_ptr;
+
+	/* Header of the objects atoms point to. The collectors find every object
+	   through heap_objects, a vector of pointers: 8 bytes an object, and index
+	   fits beside kind in the header, where an intrusive list would need two
+	   pointers in every object. */
+	struct object {
+		uint32_t refs = 0; /* not atomic; atoms are not shared between threads */
+		uint32_t index : 27; /* position in heap_objects */
+		uint32_t kind : 5; /* enum type of the object */
+		static const size_t max_objects = (size_t)1 << 27; /* that index can hold */
+		object(enum type kind);
+		~object();
+	};
+
+	static_assert(T_STRBUF < 1 << 5, "the kind of an object holds its type");
+
+	/* Upper 16 bits of the atoms that are not numbers. These are NaNs that no
+	   arithmetic produces once make_number has canonicalized NaN results. */
+	enum : uint64_t {
+		TAG_NIL = 0xFFF1, TAG_SYM, TAG_BUILTIN, TAG_INPUT, TAG_INPUT_PIPE, TAG_OUTPUT, TAG_CHAR, TAG_CONTINUATION,
+		TAG_CONS, TAG_CLOSURE, TAG_MACRO, TAG_STRING, TAG_TABLE, TAG_VECTOR, /* pointers to objects, from TAG_CONS up */
+		TAG_OBJECT /* pointer to an object of another type, which its header tells */
+	};
+
+	constexpr uint64_t tag_of_type[] = { TAG_NIL, TAG_CONS, TAG_SYM, TAG_OBJECT /* an int_object */, TAG_BUILTIN, TAG_CLOSURE, TAG_MACRO,
+		TAG_STRING, TAG_INPUT, TAG_INPUT_PIPE, TAG_OUTPUT, TAG_TABLE, TAG_CHAR, TAG_CONTINUATION, TAG_VECTOR,
+		TAG_OBJECT, TAG_OBJECT, TAG_OBJECT, TAG_OBJECT };
+	constexpr enum type type_of_tag[] = { T_NIL, T_SYM, T_BUILTIN, T_INPUT, T_INPUT_PIPE, T_OUTPUT, T_CHAR,
+		T_CONTINUATION, T_CONS, T_CLOSURE, T_MACRO, T_STRING, T_TABLE, T_VECTOR };
+	constexpr uint64_t payload_mask = 0xFFFFFFFFFFFF; /* immediates and pointers take 48 bits */
+
+	/* Upper 16 bits of an integer in 48 bits, which is a number, held as a NaN
+	   that make_number never makes. Larger integers are objects of type T_NUM. */
+	constexpr uint64_t TAG_FIXNUM = 0x7FF9;
+
+	inline void possible_cycle(struct object *o);
+
+	/* A value in 64 bits. A number is its double or an integer; any other value is a NaN boxing
+	   a tag and a symbol, character or pointer. An atom holds a reference to the object it points to. */
 	struct atom {
-		enum type type = T_NIL;
-		std::variant<
-			std::monostate,
-			std::shared_ptr<struct cons>,
-			sym,
-			double,
-			builtin,
-			std::shared_ptr<struct closure>,
-			std::shared_ptr<std::string>,
-			FILE *,
-			std::shared_ptr<table>,
-			char,
-			jmp_buf *> val;
+		uint64_t bits = TAG_NIL << 48;
 
+		atom() = default;
+		atom(enum type t, uint64_t payload) : bits(tag_of_type[t] << 48 | payload) {}
+		atom(enum type t, struct object *p) : bits(tag_of_type[t] << 48 | (uint64_t)(uintptr_t)p) { p->refs++; }
+		atom(const atom &a) : bits(a.bits) { if (heap()) obj()->refs++; }
+		atom(atom &&a) noexcept : bits(a.bits) { a.bits = TAG_NIL << 48; }
+		~atom() { release(); }
+
+		atom &operator =(const atom &a) {
+			uint64_t b = a.bits; /* a may live in the object released below */
+			if (a.heap()) a.obj()->refs++;
+			release();
+			bits = b;
+			return *this;
+		}
+
+		atom &operator =(atom &&a) noexcept {
+			uint64_t b = a.bits;
+			a.bits = TAG_NIL << 48;
+			release();
+			bits = b;
+			return *this;
+		}
+
+		enum type type() const {
+			if (bits < TAG_NIL << 48) return T_NUM;
+			if (bits >= TAG_OBJECT << 48) return (enum type)obj()->kind;
+			return type_of_tag[(bits >> 48) - TAG_NIL];
+		}
+		/* changes between closure and macro, which point to the same kind of object */
+		void set_type(enum type t) { bits = tag_of_type[t] << 48 | (bits & payload_mask); }
+		bool heap() const { return bits >= TAG_CONS << 48; }
+		struct object *obj() const { return (struct object *)(uintptr_t)(bits & payload_mask); }
+
+		/* a number that holds an integer exactly, rather than a double */
+		bool is_int() const { return bits >> 48 == TAG_FIXNUM || (bits >= TAG_OBJECT << 48 && obj()->kind == T_NUM); }
+		int64_t integer() const { return bits >> 48 == TAG_FIXNUM ? (int64_t)(bits << 16) >> 16 : boxed_integer(); }
+		double number() const {
+			if (bits >> 48 == TAG_FIXNUM) return (double)integer();
+			if (bits >= TAG_OBJECT << 48 && obj()->kind == T_NUM) return (double)boxed_integer();
+			double x;
+			memcpy(&x, &bits, sizeof(x));
+			return x;
+		}
+		sym symbol() const { return (sym)(bits & payload_mask); }
+		uint32_t character() const { return (uint32_t)(bits & payload_mask); } /* a code point */
+		builtin fn() const { return (builtin)(uintptr_t)(bits & payload_mask); }
+		FILE *file() const { return (FILE *)(uintptr_t)(bits & payload_mask); }
+		jmp_buf *continuation() const { return (jmp_buf *)(uintptr_t)(bits & payload_mask); }
+
+		/* the cons, closure, std::string, table, vector, f64array or sorted table the atom points to */
 		template <typename T>
-		T& asp() const { return *std::get<std::shared_ptr<T>>(val); }
+		T& asp() const;
 
 		friend bool operator ==(const atom &a, const atom &b);
+
+	private:
+		int64_t boxed_integer() const;
+		void release() {
+			if (!heap()) return;
+			struct object *o = obj();
+			if (--o->refs == 0) destroy();
+			else if (o->kind == T_CLOSURE) possible_cycle(o);
+		}
+		void destroy();
 	};
 
-	struct cons {
+	static_assert(sizeof(atom) == 8, "atom must be one word");
+
+	size_t hash_atom(const atom &a);
+
+	/* Table of atoms to atoms with open addressing and linear probing. Each
+	   slot keeps the hash of its key, and a control byte per slot holds the
+	   top 7 bits of that hash, so that a probe reads the keys only when those
+	   match, and growing never hashes a key again. A removed key leaves a
+	   tombstone, which probes pass over, until the next rehash drops it. Keys
+	   are compared with iso, or by identity in an eq table. */
+	class table {
+	public:
+		struct slot {
+			uint64_t hash;
+			atom first, second; /* key and value */
+		};
+
+		/* Visits the slots in use by index, so that an insertion during the
+		   visit cannot leave it dangling. */
+		class iterator {
+		public:
+			iterator(table *t, size_t i) : t(t), i(t->next(i)) {}
+			slot &operator *() const { return t->slots[i]; }
+			slot *operator ->() const { return &t->slots[i]; }
+			iterator &operator ++() { i = t->next(i + 1); return *this; }
+			bool operator !=(const iterator &b) const { return i != b.i; }
+		private:
+			table *t;
+			size_t i;
+		};
+
+		const bool eq;
+
+		explicit table(bool eq = false) : eq(eq) {}
+		atom *find(const atom &key); /* the value of key, or nullptr */
+		atom &operator [](const atom &key); /* adds key with the value nil if missing */
+		void erase(const atom &key);
+		size_t size() const { return count; }
+		void clear();
+		iterator begin() { return iterator(this, 0); }
+		iterator end() { return iterator(this, slots.size()); }
+
+	private:
+		static constexpr uint8_t empty = 0x80, deleted = 0xFE; /* both with the top bit set */
+		std::vector<uint8_t> ctrl; /* empty, deleted, or the top 7 bits of the hash of the slot's key */
+		std::vector<slot> slots; /* a power of two of them, at most 3/4 used or deleted */
+		size_t count = 0, tombstones = 0;
+
+		uint64_t hash(const atom &key) const;
+		size_t probe(const atom &key, uint64_t h) const;
+		void grow();
+		size_t next(size_t i) const {
+			while (i < slots.size() && ctrl[i] & 0x80) i++;
+			return i;
+		}
+	};
+
+	/* the order of the keys of a sorted table: numbers by value, then strings */
+	bool sorted_less(const atom &a, const atom &b);
+
+	/* Map ordered by its keys, which are numbers or strings: a B+ tree whose
+	   leaves hold the entries in order, linked both ways. A node fills a few
+	   cache lines, so a lookup touches few of them. Removal drops the nodes it
+	   empties but does not merge the others, which need only their order. */
+	class sorted_table {
+	public:
+		static const int max_keys = 32; /* per node */
+
+		struct node {
+			bool is_leaf;
+			int n = 0; /* keys in use */
+			atom keys[max_keys];
+			node(bool is_leaf) : is_leaf(is_leaf) {}
+		};
+		struct leaf : node {
+			atom values[max_keys];
+			leaf *prev = nullptr, *next = nullptr;
+			leaf() : node(true) {}
+		};
+		struct inner : node { /* keys[i] is the least key under children[i + 1] */
+			node *children[max_keys + 1];
+			inner() : node(false) {}
+		};
+
+		struct entry {
+			leaf *l;
+			int i;
+			const atom &key() const { return l->keys[i]; }
+			atom &value() const { return l->values[i]; }
+			explicit operator bool() const { return l != nullptr; }
+			entry next() const; /* the entry after this one, or none */
+			entry prev() const;
+		};
+
+		sorted_table() = default;
+		sorted_table(const sorted_table &) = delete;
+		sorted_table &operator =(const sorted_table &) = delete;
+		~sorted_table() { clear(); }
+
+		atom *find(const atom &key); /* the value of key, or nullptr */
+		atom &operator [](const atom &key); /* adds key with the value nil if missing */
+		void erase(const atom &key);
+		size_t size() const { return count; }
+		void clear();
+		entry first() const { return { head, 0 }; } /* none when empty */
+		entry last() const { return { tail, tail ? tail->n - 1 : 0 }; }
+		entry ceiling(const atom &key) const; /* the first entry whose key is not less than key */
+		entry floor(const atom &key) const; /* the last entry whose key is not greater than key */
+
+		/* calls f(key, value) on each entry in order */
+		template <typename F>
+		void each(F f) const {
+			for (leaf *l = head; l; l = l->next) {
+				for (int i = 0; i < l->n; i++) f(l->keys[i], l->values[i]);
+			}
+		}
+
+	private:
+		node *root = nullptr;
+		leaf *head = nullptr, *tail = nullptr;
+		size_t count = 0;
+
+		leaf *find_leaf(const atom &key) const;
+		node *insert(node *n, const atom &key, atom **value, atom *sep);
+		bool remove(node *n, const atom &key);
+		static void destroy(node *n);
+	};
+
+	/* Text kept as a rope of chunks, so that an append copies only what it
+	   adds. The first chunk grows like a string up to chunk_size; the others are
+	   allocated at that size, and all but the last are full, so that the chunk of
+	   an index is found by a division. */
+	class rope {
+	public:
+		static const size_t chunk_size = 64 * 1024;
+
+		void append(std::string_view s);
+		size_t size() const { return length; } /* in bytes */
+		size_t chars() const { return count; } /* in code points */
+		char operator [](size_t i) const { return chunks[i / chunk_size][i % chunk_size]; }
+		uint32_t char_at(size_t i) const; /* scans the chunk of code point i, unless the text is ASCII */
+		std::string str() const;
+		void clear() { chunks.clear(); starts.clear(); length = count = 0; }
+
+		/* calls f(std::string_view) on each chunk in order */
+		template <typename F>
+		void each_chunk(F f) const {
+			for (auto &c : chunks) f(std::string_view(c));
+		}
+
+	private:
+		std::vector<std::string> chunks;
+		std::vector<size_t> starts; /* the code points before each chunk */
+		size_t length = 0, count = 0;
+	};
+
+	/* Map of atoms to atoms as a hash array mapped trie: each level takes 5 bits
+	   of the hash of a key, and a node keeps the entries and the children of the
+	   bits in use in two packed arrays. Nodes count their references, and a
+	   change copies the shared nodes on its path, so that a copy of a map costs
+	   one reference and shares everything it does not change. Keys whose hashes
+	   are equal go in a collision node at the bottom. Keys are compared with iso. */
+	class hamt {
+	public:
+		struct node {
+			uint32_t refs = 1;
+			unsigned gc_epoch = 0; /* collection that last marked it */
+			uint32_t datamap = 0, nodemap = 0; /* the bits of the entries and of the children */
+			std::vector<std::pair<atom, atom>> entries; /* key and value, in the order of their bits */
+			std::vector<node *> children;
+		};
+
+		hamt() = default;
+		hamt(const hamt &b) : root(b.root), count(b.count) { if (root) root->refs++; }
+		hamt &operator =(const hamt &b);
+		~hamt() { release(root); }
+
+		const atom *find(const atom &key) const; /* the value of key, or nullptr */
+		void set(const atom &key, const atom &value);
+		bool erase(const atom &key); /* whether key was there */
+		size_t size() const { return count; }
+		void clear();
+		const node *top() const { return root; }
+
+		/* calls f(key, value) on each entry */
+		template <typename F>
+		void each(F f) const { each(root, f); }
+
+	private:
+		node *root = nullptr;
+		size_t count = 0;
+
+		static void release(node *n);
+		static node *own(node *&n);
+		static bool insert(node *&n, int shift, uint64_t h, const atom &key, const atom &value);
+		static void remove(node *&n, int shift, uint64_t h, const atom &key);
+
+		template <typename F>
+		static void each(const node *n, F &f) {
+			if (!n) return;
+			for (auto &e : n->entries) f(e.first, e.second);
+			for (auto c : n->children) each(c, f);
+		}
+	};
+}
+
+namespace arc {
+	struct cons : object {
 		struct atom car, cdr;
 		cons(atom car, atom cdr);
+		static void *operator new(size_t size) { return cons_pool.alloc(size); }
+		static void operator delete(void *p) { cons_pool.free(p); }
+	};
+
+	/* integer too large for an atom */
+	struct int_object : object {
+		int64_t value;
+		int_object(int64_t value);
+	};
+
+	/* Text in UTF-8. The number of its code points, and the byte offset of
+	   every index_step-th one, are counted when first needed, so that finding a
+	   code point skips fewer than index_step others. A code point starts at each
+	   byte that is not a continuation byte. */
+	struct string_object : object {
+		std::string value;
+		string_object(std::string value);
+		size_t length(); /* in code points */
+		size_t offset(size_t i); /* of code point i, which is below length */
+		void changed(); /* after a change to the bytes of value */
+
+	private:
+		static const size_t index_step = 64;
+		size_t chars = SIZE_MAX; /* not counted yet */
+		std::vector<size_t> index; /* empty when each byte starts a code point */
+		void count();
 	};
 
+	struct table_object : object {
+		table value;
+		table_object(bool eq);
+	};
+
+	struct sorted_table_object : object {
+		sorted_table value;
+		sorted_table_object();
+	};
+
+	/* string builder */
+	struct strbuf_object : object {
+		rope value;
+		strbuf_object();
+	};
+
+	/* Immutable map, or a transient one that changes in place the nodes it
+	   alone holds. */
+	struct imap_object : object {
+		hamt value;
+		bool transient;
+		imap_object(const hamt &value, bool transient);
+	};
+
+	/* elements stored contiguously, indexed in constant time */
+	struct vector_object : object {
+		std::vector<atom> value;
+		vector_object(std::vector<atom> value);
+	};
+
+	/* numbers stored unboxed, for the element-wise kernels */
+	struct f64array_object : object {
+		std::vector<double> value;
+		f64array_object(std::vector<double> value);
+	};
+
+	template <> inline struct cons& atom::asp<struct cons>() const { return *(struct cons *)obj(); }
+	inline int64_t atom::boxed_integer() const { return ((struct int_object *)obj())->value; }
+	template <> inline std::string& atom::asp<std::string>() const { return ((struct string_object *)obj())->value; }
+	template <> inline table& atom::asp<table>() const { return ((struct table_object *)obj())->value; }
+	template <> inline std::vector<atom>& atom::asp<std::vector<atom>>() const { return ((struct vector_object *)obj())->value; }
+	template <> inline std::vector<double>& atom::asp<std::vector<double>>() const { return ((struct f64array_object *)obj())->value; }
+	template <> inline sorted_table& atom::asp<sorted_table>() const { return ((struct sorted_table_object *)obj())->value; }
+	template <> inline hamt& atom::asp<hamt>() const { return ((struct imap_object *)obj())->value; }
+	template <> inline rope& atom::asp<rope>() const { return ((struct strbuf_object *)obj())->value; }
+
 	struct env {
-		std::shared_ptr<struct env> parent;
-		env_table table;
-		env(std::shared_ptr<struct env> parent);
+		uint32_t refs = 0;
+		unsigned gc_epoch = 0; /* collection that last marked it */
+		bool buffered = false; /* in cycle_candidates */
+		env_ptr parent;
+		std::vector<atom> slots; /* variables of a closure call, by index */
+		env(env_ptr parent);
+		env(env_ptr parent, size_t size);
+		static void *operator new(size_t size) { return env_pool.alloc(size); }
+		static void operator delete(void *p) { env_pool.free(p); }
+	};
+
+	extern std::vector<env_ptr> cycle_candidates;
+	extern bool cycle_buffering; /* off while gc_collect runs */
+	extern size_t cycle_purge_at; /* number of candidates that makes possible_cycle purge them */
+	void cycle_purge();
+
+	/* An env whose count drops but not to zero may be left in a cycle with a
+	   closure over it. Every cycle of envs and closures has an env in it, so
+	   the cycle collector starts from envs only. */
+	inline void possible_cycle(struct env *e) {
+		if (!e->buffered && cycle_buffering) {
+			e->buffered = true;
+			cycle_candidates.emplace_back(e);
+			if (cycle_candidates.size() >= cycle_purge_at) cycle_purge();
+		}
+	}
+
+	inline void possible_cycle(struct lambda *) {}
+
+	/* binding of a global variable. Cells never move, so code refers to them directly. */
+	struct cell {
+		atom value;
+		atom name;
+		bool bound = false;
+		unsigned long version = 0; /* incremented on every assignment */
+		uint32_t unit = 0; /* 1 + index of the image unit that defines it on first use, 0 if none */
+	};
+
+	/* inline cache of a call site whose operator is a global variable */
+	struct call_cache {
+		unsigned long version = 0; /* version of the cell when filled, 0 if empty */
+		builtin fn = nullptr; /* cached builtin, or */
+		const struct closure* cls = nullptr; /* cached closure, owned by the cell */
+		const struct lambda* target = nullptr; /* body of cls, to tell a new operator from a rebound one */
+		unsigned long hits = 0, misses = 0;
+		bool polymorphic = false; /* has seen more than one operator */
+	};
+
+	/* totals over all call sites */
+	struct call_cache_stats {
+		unsigned long hits = 0, misses = 0, monomorphic = 0, polymorphic = 0;
+	};
+
+	/* node types of the pre-analyzed expression tree */
+	enum node_type {
+		N_CONST, /* self-evaluating or quoted value */
+		N_LREF, /* reference to a variable bound by an enclosing fn, by (depth, index) */
+		N_GREF, /* reference to a global variable */
+		N_LSET,
+		N_GSET,
+		N_IF,
+		N_DO,
+		N_FN,
+		N_MAC,
+		N_CALL,
+		N_ERROR /* malformed special form; the error is raised when evaluated */
+	};
+
+	typedef std::unique_ptr<struct node> node_ptr;
+
+	struct node {
+		enum node_type type;
+		atom value; /* constant, variable name or macro name */
+		int depth = 0, index = 0; /* frame and slot of N_LREF, N_LSET and local N_MAC */
+		struct cell *cell = nullptr; /* N_GREF, N_GSET and global N_MAC */
+		error err = ERROR_OK; /* N_ERROR */
+		std::vector<node_ptr> kids; /* operands */
+		lambda_ptr fn; /* N_FN, N_MAC */
+		mutable std::unique_ptr<struct call_cache> cache; /* N_CALL of a global operator */
+		node(enum node_type type);
 	};
 
-	struct closure {
-		std::shared_ptr<struct env> parent_env;
+	/* bytecode instructions of the virtual machine */
+	enum opcode {
+		OP_CONST, /* k: push constant k */
+		OP_LREF, /* d i: push slot i of the frame d levels up */
+		OP_GREF, /* c: push the value of global cell c */
+		OP_LSET, /* d i: assign the top of the stack to a slot */
+		OP_GSET, /* c: assign the top of the stack to global cell c */
+		OP_POP,
+		OP_JUMP, /* target */
+		OP_JUMP_IF_NIL, /* target: pop and jump if nil */
+		OP_FN, /* f: push a closure of lambda f */
+		OP_MAC, /* f k i c: bind a macro of lambda f named by constant k to slot i, or to cell c if i < 0 */
+		OP_CALL, /* n: call the function below n arguments */
+		OP_TAIL_CALL, /* n */
+		OP_RETURN,
+		OP_ERROR /* e: raise error e */
+	};
+
+	/* an instruction word: an opcode (or its handler address once threaded) or an operand */
+	union word {
+		intptr_t n;
+		const void *label;
+		struct cell *cell;
+	};
+
+	/* compiled code of a top-level form or a fn body */
+	struct chunk {
+		std::vector<word> code;
+		std::vector<atom> consts;
+		std::vector<lambda_ptr> fns;
+		bool threaded = false;
+	};
+
+	enum pattern_type {
+		PAT_VAR, /* binds a slot */
+		PAT_OPT, /* (o ARG [DEFAULT]) */
+		PAT_CONS, /* destructures a list */
+		PAT_NIL, /* end of a list */
+		PAT_INVALID
+	};
+
+	/* argument list of a fn with its variables resolved to slots */
+	struct pattern {
+		enum pattern_type type;
+		int slot = 0;
+		node_ptr dflt; /* PAT_OPT default expression */
+		mutable std::unique_ptr<struct chunk> compiled; /* dflt compiled by the VM */
+		std::unique_ptr<struct pattern> car, cdr; /* PAT_CONS */
+		pattern(enum pattern_type type);
+	};
+
+	/* analyzed body of a fn form, shared by all closures made from it */
+	struct lambda {
+		uint32_t refs = 0;
 		atom args;
 		atom body;
-		closure(const std::shared_ptr<struct env> &env, atom args, atom body);
+		std::unique_ptr<struct pattern> params;
+		int arity = -1; /* number of parameters if they are all plain symbols, otherwise -1 */
+		size_t frame_size = 0; /* number of slots of a call frame */
+		std::vector<node_ptr> code; /* one node per body expression */
+		mutable std::unique_ptr<struct chunk> compiled; /* compiled on the first call by the VM */
+		unsigned gc_epoch = 0; /* collection that last marked it */
+		lambda(atom args, atom body);
+	};
+
+	struct closure : object {
+		env_ptr parent_env;
+		lambda_ptr fn;
+		closure(const env_ptr &env, const lambda_ptr &fn);
+		static void *operator new(size_t size) { return closure_pool.alloc(size); }
+		static void operator delete(void *p) { closure_pool.free(p); }
+	};
+
+	template <> inline struct closure& atom::asp<struct closure>() const { return *(struct closure *)obj(); }
+
+	/* a closure whose count drops may be left in a cycle through its env */
+	inline void possible_cycle(struct object *o) {
+		struct closure *c = (struct closure *)o;
+		if (c->parent_env) possible_cycle(c->parent_env.get());
+	}
+
+	/* An atom that the collector must keep alive while it is registered.
+	   Only atoms held by C++ code across a safe point need one. */
+	struct gc_root {
+		gc_root(const atom *a);
+		~gc_root();
+	};
+
+	/* collector counters */
+	struct gc_stats {
+		unsigned long collections = 0, freed = 0;
+		double time = 0; /* seconds spent marking and sweeping */
+		unsigned long cycle_runs = 0, cycle_freed = 0; /* by trial deletion */
+		double cycle_time = 0, cycle_max_pause = 0;
 	};
 
 	/* forward declarations */
@@ -106,12 +748,31 @@ namespace arc {
 	int listp(atom expr);
 	char *slurp_fp(FILE *fp);
 	char *slurp(const char *path);
-	error eval_expr(atom expr, std::shared_ptr<struct env> env, atom *result);
+	env_ptr make_env(env_ptr parent, size_t size);
+	error eval_expr(atom expr, env_ptr env, atom *result);
+	struct cell *global_cell(sym s);
+	error global_get(struct cell *c, atom *result);
+	void global_set(struct cell *c, const atom &value);
+	error image_load_unit(uint32_t unit);
+	node_ptr analyze(const atom &expr, struct scope *sc);
+	error eval_node(const struct node *n, env_ptr env, atom *result);
+	void compile(const struct node *n, struct chunk *ch);
+	error vm_run(struct chunk *ch, env_ptr env, atom *result);
+	error vm_apply(const atom &fn, const std::vector<atom> &args, atom *result);
+	extern bool use_vm;
 	error macex(atom expr, atom *result);
 	std::string to_string(atom a, int write);
+	void append_display(std::string &s, const atom &a);
+	void print_atom(FILE *fp, const atom &a, int write);
 	error macex_eval(atom expr, atom *result);
 	error arc_load_file(const char *path);
 	void arc_init();
+	void gc_collect();
+	void gc_safe_point();
+	void gc_poll_collect();
+	error arc_init_image(const char *path);
+	error arc_dump_image(const char *path);
+	error arc_dump_prelude(const char *path);
 #ifndef READLINE
 	char *readline(const char *prompt);
 #endif
@@ -121,7 +782,12 @@ namespace arc {
 	void print_error(error e);
 	bool is(const atom &a, const atom &b);
 	bool iso(const atom& a, const atom& b);
-	atom make_table();
+	atom make_table(bool eq = false);
+	atom make_sorted_table();
+	atom make_imap(const hamt &value, bool transient = false);
+	atom make_strbuf();
+	atom make_vector(std::vector<atom> v);
+	atom make_f64array(std::vector<double> v);
 	void repl();
 	atom make_cons(const atom &car_val, const atom &cdr_val);
 	atom & car(const atom & a);
@@ -131,49 +797,4 @@ namespace arc {
 	/* end forward */
 }
 
-namespace std {
-	template<>
-	struct hash<arc::atom> {
-		size_t operator ()(arc::atom a) const {
-			size_t r = 1;
-			switch (a.type) {
-			case arc::T_NIL:
-				return 0;
-			case arc::T_CONS:
-				while (!no(a)) {
-					r *= 31;
-					if (a.type == arc::T_CONS) {
-						r += hash<arc::atom>()(car(a));
-						a = cdr(a);
-					}
-					else {
-						r += hash<arc::atom>()(a);
-						break;
-					}
-				}
-				return r;
-			case arc::T_SYM:
-				return hash<arc::sym>()(std::get<arc::sym>(a.val));
-			case arc::T_STRING: {
-				return hash<string>()(a.asp<string>());
-			}
-			case arc::T_NUM: {
-				return hash<double>()(std::get<double>(a.val));
-			}
-			case arc::T_CLOSURE:
-				return hash<arc::atom>()(cdr(a));
-			case arc::T_MACRO:
-				return hash<arc::atom>()(cdr(a));
-			case arc::T_BUILTIN:
-				return hash<arc::builtin>()(std::get<arc::builtin>(a.val));
-			case arc::T_INPUT:
-			case arc::T_INPUT_PIPE:
-			case arc::T_OUTPUT:
-				return hash<void *>()(std::get<FILE *>(a.val));
-			default:
-				return 0;
-			}
-		}
-	};
-}
 #endif
@@ -99,9 +99,6 @@ function 'f' to them."
         (apply join (cdr args))
         (cons (car a) (apply join (cons (cdr a) (cdr args))))))))
 
-(= uniq (let uniq-count 0
-  (fn () (sym (string "_uniq" (= uniq-count (+ uniq-count 1)))))))
-
 (mac w/uniq (names . body)
   (if (isa names 'cons)
     `(with ,(apply join (map1 (fn (x) (list x '(uniq))) names))
@@ -125,8 +122,8 @@ function 'f' to them."
      (w/uniq (seq i)
 	     `(let ,seq ,expr
 		   (if (isa ,seq 'cons) (while ,seq (= ,var (car ,seq)) ,@body (= ,seq (cdr ,seq)))
-		       (isa ,seq 'table) (maptable (fn ,var ,@body) ,seq)
-		       'else (let ,i 0 (while (isnt (,seq ,i) #\nul) (= ,var (,seq ,i)) ,@body (++ ,i)))))))
+		       (or (isa ,seq 'table) (isa ,seq 'sorted-table) (isa ,seq 'imap)) (maptable (fn ,var ,@body) ,seq)
+		       'else (let ,i 0 (while (< ,i (len ,seq)) (= ,var (,seq ,i)) ,@body (++ ,i)))))))
 
 (mac and args
 "Stops at the first argument to fail (return nil). Returns the last argument before stopping."
@@ -151,7 +148,11 @@ the same elements (be *isomorphic*) without being identical."
       (and (acons x)
            (acons y)
            (iso (car x) (car y))
-           (iso (cdr x) (cdr y)))))
+           (iso (cdr x) (cdr y)))
+      (and (or (isa x 'vector) (isa x 'f64array))
+           (is (type x) (type y))
+           (is (len x) (len y))
+           (iso (coerce x 'cons) (coerce y 'cons)))))
 
 (def <= args
 "Is each element of 'args' lesser than or equal to all following elements?"
@@ -211,7 +212,7 @@ the same elements (be *isomorphic*) without being identical."
 (def sref (object value index)
   (let type- (type object)
     (if (is type- 'cons) (scar (nthcdr index object) value)
-	((if (is type- 'string) string-sref table-sref) object value index))))
+	((if (is type- 'string) string-sref (is type- 'vector) vector-sref (is type- 'f64array) f64array-sref (is type- 'sorted-table) sorted-table-sref (is type- 'imap) imap-sref table-sref) object value index))))
 
 ; = place value ...
 (mac = args
@@ -337,12 +338,16 @@ For examples, see [[aif]]."
 		   wins))
 
 (def max args
-  "Returns the greatest of 'args'."
-  (best > args))
+  "Returns the greatest of 'args', or of the elements of an f64array passed alone."
+  (if (and args (no (cdr args)) (isa (car args) 'f64array))
+      (f64array-max (car args))
+      (best > args)))
 
 (def min args
-  "Returns the least of 'args'."
-  (best < args))
+  "Returns the least of 'args', or of the elements of an f64array passed alone."
+  (if (and args (no (cdr args)) (isa (car args) 'f64array))
+      (f64array-min (car args))
+      (best < args)))
 
 (def firstn (n xs)
 	"Returns the first 'n' elements of 'xs'."
@@ -444,13 +449,6 @@ to be isolated from the copy."
     (cons (copy (car x))
           (copy (cdr x)))))
 
-; Use mergesort on assumption that mostly sorting mostly sorted lists
-(def sort (test seq)
-"Orders a list 'seq' by comparing its elements using 'test'."
-  (if (alist seq)
-    (mergesort test (copy seq))
-    (coerce (mergesort test (coerce seq 'cons)) (type seq))))
-
 (def med (ns (o test >))
 	"Returns the median of a list of numbers 'ns' according to the comparison 'test'. Takes the later element for an even-length list."
 	((sort test ns) (trunc (/ (len ns) 2))))
@@ -540,11 +538,11 @@ Matches 'expr' to the first satisfying 'test' and runs the corresponding 'then'
      "Runs 'body' to add to table 'var' and finally return it."
      `(let ,var (table) ,@body ,var))
 
-(def memtable ((o keys nil) (o val t))
-  "Turns a list into a table indicating membership of all elements."
-  (w/table tbl
-    (each key keys
-      (= tbl.key val))))
+(def memtable ((o keys nil) (o val t) (o tbl (table)))
+  "Turns a list into a table indicating membership of all elements. Pass (table 'eq) as 'tbl' to compare the elements by identity."
+  (each key keys
+    (= tbl.key val))
+  tbl)
 
 (def pos (test seq (o start 0))
   "Returns the index of the first element of 'seq' matching 'test', starting
@@ -861,7 +859,7 @@ negative to count backwards from the end."
        (rev ,ga))))
 
 (def counts (seq (o tbl (table)))
-"Returns a table with counts of each unique element in 'seq'."
+"Returns a table with counts of each unique element in 'seq'. Pass (table 'eq) as 'tbl' to count by identity."
   (let ans tbl
     (each x seq
 	  (++ (ans x 0)))
@@ -992,10 +990,12 @@ not preserved."
 
 (def sum (f xs)
 "Returns total of all elements in (map1 f xs)."
-  (let n 0
-    (each x xs
-	  (++ n f.x))
-    n))
+  (if (and (is f idfn) (isa xs 'f64array))
+      (f64array-sum xs)
+      (let n 0
+        (each x xs
+	      (++ n f.x))
+        n)))
 
 (mac rand-choice exprs
 "Runs one of the given 'exprs' at random and returns the result."
@@ -6,36 +6,73 @@ void print_logo() {
 	printf("Arc++ %s\n", VERSION);
 }
 
-int main(int argc, char **argv)
-{
-	if (argc == 1) { /* REPL */
-		print_logo();
+/* sets up the global environment from the standard library or an image */
+bool init(const char *image) {
+	if (!image) {
 		arc::arc_init();
-		arc::repl();
-		puts("");
-		return 0;
+		return true;
 	}
-	else if (argc == 2) {
-		char *opt = argv[1];
+	arc::error err = arc::arc_init_image(image);
+	if (err) {
+		fprintf(stderr, "Cannot load image %s\n", image);
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+	const char *image = nullptr, *dump_image = nullptr, *dump_prelude = nullptr;
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) { /* options */
+		char *opt = argv[i];
 		if (strcmp(opt, "-h") == 0) {
 			puts("Usage: arcadia [OPTIONS...] [FILES...]");
 			puts("");
 			puts("OPTIONS:");
 			puts("    -h    print this screen.");
 			puts("    -v    print version.");
+			puts("    --vm  run code with the bytecode VM.");
+			puts("    --image FILE");
+			puts("          start from an image instead of loading the library.");
+			puts("    --dump-image FILE");
+			puts("          load the library and FILES, save an image and exit.");
 			return 0;
 		}
 		else if (strcmp(opt, "-v") == 0) {
 			puts(VERSION);
 			return 0;
 		}
+		else if (strcmp(opt, "--vm") == 0) {
+			arc::use_vm = true;
+		}
+		else if (strcmp(opt, "--image") == 0 && i + 1 < argc) {
+			image = argv[++i];
+		}
+		else if (strcmp(opt, "--dump-image") == 0 && i + 1 < argc) {
+			dump_image = argv[++i];
+		}
+		else if (strcmp(opt, "--dump-prelude") == 0 && i + 1 < argc) { /* used by the build */
+			dump_prelude = argv[++i];
+		}
+		else {
+			fprintf(stderr, "Unknown option: %s\n", opt);
+			return 1;
+		}
+	}
+
+	if (i == argc && !dump_image && !dump_prelude) { /* REPL */
+		print_logo();
+		if (!init(image)) return 1;
+		arc::repl();
+		puts("");
+		return 0;
 	}
 	
 	/* execute files */
-	arc::arc_init();
-	int i;
-	arc::error err;
-	for (i = 1; i < argc; i++) {
+	if (!init(image)) return 1;
+	arc::error err = arc::ERROR_OK;
+	for (; i < argc; i++) {
 		err = arc::arc_load_file(argv[i]);
 		if (err) {
 			fprintf(stderr, "In file %s:\n", argv[i]);
@@ -43,5 +80,21 @@ int main(int argc, char **argv)
 			break;
 		}
 	}
+	if (dump_image && !err) {
+		err = arc::arc_dump_image(dump_image);
+		if (err) {
+			fprintf(stderr, "Cannot save image %s\n", dump_image);
+			print_error(err);
+			return 1;
+		}
+	}
+	if (dump_prelude && !err) {
+		err = arc::arc_dump_prelude(dump_prelude);
+		if (err) {
+			fprintf(stderr, "Cannot save prelude %s\n", dump_prelude);
+			print_error(err);
+			return 1;
+		}
+	}
 	return 0;
 }
@@ -0,0 +1,23 @@
+# Runs each line of errors.txt that is not blank or a # comment as a script of
+# its own with both engines. A line reads as the error it must print, like
+# "Out of range: (\"abc\" 3)". Run with cmake -P, given ARC, the interpreter,
+# TESTS_DIR and WORK_DIR, a scratch directory.
+
+file(STRINGS ${TESTS_DIR}/errors.txt lines ENCODING UTF-8)
+foreach(line IN LISTS lines)
+	if (line STREQUAL "" OR line MATCHES "^#")
+		continue()
+	endif()
+	string(FIND "${line}" ": " colon)
+	math(EXPR start "${colon} + 2")
+	string(SUBSTRING "${line}" ${start} -1 expr)
+	file(WRITE ${WORK_DIR}/error.arc "${expr}\n")
+	foreach(ENGINE "" --vm)
+		execute_process(COMMAND ${ARC} ${ENGINE} error.arc
+			WORKING_DIRECTORY ${WORK_DIR} OUTPUT_VARIABLE out ERROR_VARIABLE out)
+		string(FIND "${out}" "${line}" found)
+		if (found EQUAL -1)
+			message(SEND_ERROR "${expr} ${ENGINE} should print \"${line}\" but printed:\n${out}")
+		endif()
+	endforeach()
+endforeach()
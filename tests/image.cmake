@@ -0,0 +1,23 @@
+# Saves an image after image-dump.arc, runs image-load.arc on it with both
+# engines, and loads a truncated copy, which must fail. Run with cmake -P,
+# given ARC, the interpreter, TESTS_DIR and WORK_DIR, a scratch directory.
+
+execute_process(COMMAND ${ARC} --dump-image ${WORK_DIR}/test.image image-dump.arc
+	WORKING_DIRECTORY ${TESTS_DIR} RESULT_VARIABLE r OUTPUT_VARIABLE out ERROR_VARIABLE out)
+if (NOT r EQUAL 0 OR out MATCHES "In file")
+	message(FATAL_ERROR "--dump-image failed:\n${out}")
+endif()
+
+foreach(ENGINE "" --vm)
+	execute_process(COMMAND ${ARC} ${ENGINE} --image test.image ${TESTS_DIR}/image-load.arc
+		WORKING_DIRECTORY ${WORK_DIR} RESULT_VARIABLE r OUTPUT_VARIABLE out ERROR_VARIABLE out)
+	if (NOT r EQUAL 0 OR NOT out MATCHES "image ok")
+		message(FATAL_ERROR "--image ${ENGINE} failed:\n${out}")
+	endif()
+endforeach()
+
+execute_process(COMMAND ${ARC} --image truncated.image ${TESTS_DIR}/image-load.arc
+	WORKING_DIRECTORY ${WORK_DIR} RESULT_VARIABLE r OUTPUT_VARIABLE out ERROR_VARIABLE out)
+if (NOT r EQUAL 1 OR NOT out MATCHES "Cannot load image")
+	message(FATAL_ERROR "a truncated image loaded (status ${r}):\n${out}")
+endif()